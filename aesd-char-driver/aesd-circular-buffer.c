@@ -16,6 +16,69 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * Fills in @param view from @param buffer.  Any necessary locking must be performed by caller.
+ */
+void aesd_circular_buffer_view(struct aesd_circular_buffer *buffer, struct aesd_buffer_view *view)
+{
+    view->entry = buffer->entry;
+    view->capacity = buffer->capacity;
+    view->out_offs = buffer->out_offs;
+    view->count = aesd_circular_buffer_count(buffer);
+    view->char_size = buffer->char_size;
+    view->total_size = buffer->total_size;
+    view->next_seq = buffer->next_seq;
+}
+
+/**
+ * Same as aesd_circular_buffer_find_entry_offset_for_fpos, on a view of the buffer
+ */
+struct aesd_buffer_entry *aesd_buffer_view_find_entry_offset_for_fpos(struct aesd_buffer_view *view,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    uint64_t target;
+    size_t low = 0;
+    size_t high;
+    size_t mid;
+
+    if(char_offset >= view->char_size){
+        return NULL;
+    }
+
+    // Entry starts only ever grow from the oldest (out_offs) to the newest, so
+    // binary search for the last entry starting at or before the absolute
+    // position. The oldest retained byte sits char_size back from the end.
+    target = view->total_size - view->char_size + char_offset;
+    high = view->count - 1;
+    while(low < high){
+        mid = low + (high - low + 1) / 2;
+        if(view->entry[(view->out_offs + mid) % view->capacity].start <= target){
+            low = mid;
+        }
+        else{
+            high = mid - 1;
+        }
+    }
+
+    entry = &view->entry[(view->out_offs + low) % view->capacity];
+    *entry_offset_byte_rtn = target - entry->start;
+    return entry;
+}
+
+/**
+ * Same as aesd_circular_buffer_get_entry, on a view of the buffer
+ */
+struct aesd_buffer_entry *aesd_buffer_view_get_entry(struct aesd_buffer_view *view,
+            size_t entry_offset)
+{
+    if(entry_offset >= view->count){
+        return NULL;
+    }
+
+    return &view->entry[(view->out_offs + entry_offset) % view->capacity];
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -29,31 +92,24 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t count = 0;
-    size_t current_size;
-    size_t i = 0;
-    
-    // Starting from the output offet (the least recent thing entered into the buffer),
-    // Loop through the whole buffer if it's full OR
-    // If it's not full, loop until the output offset + the current loop count
-    // = the input offset, with wrapping
-    while(( buffer->full && (i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)) || 
-          (!buffer->full && !(((buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) == buffer->in_offs))) {
-        
-        // Find the size of the next string
-        current_size = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
-
-        // check if the current sting contained the desired offeset and return if so
-        count += current_size;
-        if(count > char_offset){
-            *entry_offset_byte_rtn = char_offset - (count - current_size);
-            return &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
-        }
+    struct aesd_buffer_view view;
 
-        i++;
-    }
+    aesd_circular_buffer_view(buffer, &view);
+    return aesd_buffer_view_find_entry_offset_for_fpos(&view, char_offset, entry_offset_byte_rtn);
+}
 
-    return NULL;
+/**
+ * @param buffer the buffer to look in.  Any necessary locking must be performed by caller.
+ * @param entry_offset the position of the entry in the circular buffer, 0 being the oldest
+ * @return the entry at that position, or NULL if there aren't that many entries
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_offset)
+{
+    struct aesd_buffer_view view;
+
+    aesd_circular_buffer_view(buffer, &view);
+    return aesd_buffer_view_get_entry(&view, entry_offset);
 }
 
 /**
@@ -66,35 +122,46 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 ssize_t aesd_circular_buffer_find_fpos_for_entry_offset(struct aesd_circular_buffer *buffer,
             size_t entry_offset, size_t char_offset)
 {
-    size_t count = 0;
-    size_t current_size;
-    size_t i = 0;
-    
-    // Starting from the output offet (the least recent thing entered into the buffer),
-    // Loop through the whole buffer if it's full OR
-    // If it's not full, loop until the output offset + the current loop count
-    // = the input offset, with wrapping
-    while(( buffer->full && (i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)) || 
-          (!buffer->full && !(((buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) == buffer->in_offs))) {
-        
-        // Find the size of the next string
-        current_size = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
-
-        // check if we found the right entry
-        if(i == entry_offset){
-
-            if(char_offset >= current_size){
-                return -1;
-            }
-
-            return count + char_offset;
-        }
+    struct aesd_buffer_entry *entry;
 
-        count += current_size;
-        i++;
+    // every entry knows where it starts, no need to walk the ones before it
+    entry = aesd_circular_buffer_get_entry(buffer, entry_offset);
+    if(entry == NULL || char_offset >= entry->size){
+        return -1;
     }
 
-    return -1;
+    return entry->start - (buffer->total_size - buffer->char_size) + char_offset;
+}
+
+/**
+ * @param buffer the buffer to look in.  Any necessary locking must be performed by caller.
+ * @return the sequence number of the oldest entry in the buffer, buffer->next_seq if it's empty
+ */
+uint64_t aesd_circular_buffer_first_seq(struct aesd_circular_buffer *buffer)
+{
+    // sequence numbers have no gaps and only the oldest entries are ever removed
+    return buffer->next_seq - aesd_circular_buffer_count(buffer);
+}
+
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param seq the sequence number of the entry to find, buffer->next_seq for the end of the buffer
+ * @return the value of fpos where the entry starts, -1 if it was evicted or hasn't been added yet
+ */
+ssize_t aesd_circular_buffer_find_fpos_for_seq(struct aesd_circular_buffer *buffer, uint64_t seq)
+{
+    uint64_t first = aesd_circular_buffer_first_seq(buffer);
+
+    if(seq == buffer->next_seq){
+        return buffer->char_size;
+    }
+
+    if(seq < first || seq > buffer->next_seq){
+        return -1;
+    }
+
+    // sequence numbers have no gaps, so it's the same as looking up by index
+    return aesd_circular_buffer_find_fpos_for_entry_offset(buffer, seq - first, 0);
 }
 
 /**
@@ -112,24 +179,94 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     if((buffer->in_offs == buffer->out_offs) && buffer->full){
         ret = buffer->entry[buffer->out_offs].buffptr;
         buffer->char_size -= buffer->entry[buffer->out_offs].size;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
     }
 
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].start = buffer->total_size;
+    buffer->entry[buffer->in_offs].seq = buffer->next_seq++;
     buffer->char_size += add_entry->size;
+    buffer->total_size += add_entry->size;
 
     // handle input increase and rollover if full
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
     buffer->full = (buffer->in_offs == buffer->out_offs);
 
     return ret;
 }
 
+/**
+* Removes the oldest entry from @param buffer, if there is one.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry for the caller to free, NULL if the buffer was empty
+*/
+const char *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    const char *ret;
+
+    if(!buffer->full && (buffer->in_offs == buffer->out_offs)){
+        return NULL;
+    }
+
+    ret = buffer->entry[buffer->out_offs].buffptr;
+    buffer->char_size -= buffer->entry[buffer->out_offs].size;
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+
+    return ret;
+}
+
+/**
+* @return the number of entries currently stored in @param buffer
+*/
+size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    if(buffer->full){
+        return buffer->capacity;
+    }
+
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
+/**
+* Moves the contents of @param buffer into @param entries, an array of @param capacity
+* zeroed entries, which the buffer uses from then on. Entries are stored oldest first.
+* The buffer must not hold more than @param capacity entries, remove the oldest ones
+* with aesd_circular_buffer_remove_entry first when shrinking.
+* Any necessary locking must be handled by the caller
+* @return the array previously provided through this function for the caller to free,
+* NULL if the buffer was still using its built in storage
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, size_t capacity)
+{
+    struct aesd_buffer_entry *old = buffer->entry;
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t i;
+
+    for(i = 0; i < count; i++){
+        entries[i] = buffer->entry[(buffer->out_offs + i) % buffer->capacity];
+    }
+
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = count % capacity;
+    buffer->full = (count == capacity);
+
+    return (old == buffer->default_entry) ? NULL : old;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
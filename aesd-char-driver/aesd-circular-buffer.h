@@ -17,6 +17,10 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of entries held by a freshly initialized buffer, more (or fewer) can
+ * be provided afterwards with aesd_circular_buffer_set_storage
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -29,6 +33,16 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte of buffptr counting every byte ever added to the
+     * buffer, set by aesd_circular_buffer_add_entry
+     */
+    uint64_t start;
+    /**
+     * Sequence number of the entry, one more than the entry added before it, set by
+     * aesd_circular_buffer_add_entry
+     */
+    uint64_t seq;
 };
 
 struct aesd_circular_buffer
@@ -36,16 +50,24 @@ struct aesd_circular_buffer
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of entries in the entry array
+     */
+    size_t capacity;
+    /**
+     * Storage used for the entry array until the owner provides its own
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    size_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    size_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -54,16 +76,64 @@ struct aesd_circular_buffer
      * total number of bytes/chars stored in the buffer
     */
     size_t char_size;
+    /**
+     * total number of bytes/chars ever added to the buffer, including evicted entries
+     */
+    uint64_t total_size;
+    /**
+     * Sequence number the next entry added will get, the first is 0
+     */
+    uint64_t next_seq;
 };
 
+/**
+ * The bookkeeping of a buffer without its storage, enough to look entries up in the
+ * buffer's entry array. Small enough for a lockless reader to take a copy of.
+ */
+struct aesd_buffer_view
+{
+    struct aesd_buffer_entry *entry;
+    size_t capacity;
+    size_t out_offs;
+    /**
+     * Number of entries stored
+     */
+    size_t count;
+    size_t char_size;
+    uint64_t total_size;
+    uint64_t next_seq;
+};
+
+extern void aesd_circular_buffer_view(struct aesd_circular_buffer *buffer, struct aesd_buffer_view *view);
+
+extern struct aesd_buffer_entry *aesd_buffer_view_find_entry_offset_for_fpos(struct aesd_buffer_view *view,
+            size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern struct aesd_buffer_entry *aesd_buffer_view_get_entry(struct aesd_buffer_view *view,
+            size_t entry_offset);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            size_t entry_offset);
+
 extern ssize_t aesd_circular_buffer_find_fpos_for_entry_offset(struct aesd_circular_buffer *buffer,
             size_t entry_offset, size_t char_offset);
 
+extern uint64_t aesd_circular_buffer_first_seq(struct aesd_circular_buffer *buffer);
+
+extern ssize_t aesd_circular_buffer_find_fpos_for_seq(struct aesd_circular_buffer *buffer, uint64_t seq);
+
 extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, size_t capacity);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -71,9 +141,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -82,7 +152,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
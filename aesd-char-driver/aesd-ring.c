@@ -0,0 +1,157 @@
+/**
+ * @file aesd-ring.c
+ * @brief Page backed line storage for the AESD char driver
+ *
+ * Lines are copied back to back into a vmalloc'd ring. A line never wraps: if
+ * it doesn't fit before the end of the ring the rest of the ring is skipped
+ * and it goes at the start. The oldest lines are released by the caller (in
+ * the same order they were added) to make room. The first page of the area
+ * holds a header describing the ring so the whole thing can be mapped read
+ * only into user space.
+ * Any necessary locking must be handled by the caller.
+ *
+ * @author James Bohn
+ * @date 2026-10-16
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <asm/barrier.h>
+#include "aesd-ring.h"
+
+/**
+ * Copy the ring state into the header user space sees. seq is odd while the
+ * header is being changed so readers can tell to retry.
+ */
+static void aesd_ring_publish(struct aesd_ring *ring)
+{
+    struct aesd_ring_header *hdr = ring->hdr;
+
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(hdr->head, ring->head);
+    WRITE_ONCE(hdr->tail, ring->tail);
+    WRITE_ONCE(hdr->used, ring->used);
+    WRITE_ONCE(hdr->wrap, ring->wrap);
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/**
+ * Allocate an empty ring holding @param size bytes of line data (rounded up to
+ * a whole page)
+ * @return 0 on success, -ENOMEM on failure
+ */
+int aesd_ring_init(struct aesd_ring *ring, size_t size)
+{
+    size = PAGE_ALIGN(size);
+
+    ring->area = vmalloc_user(PAGE_SIZE + size);
+    if(ring->area == NULL){
+        return -ENOMEM;
+    }
+
+    ring->hdr = ring->area;
+    ring->data = (char *)ring->area + PAGE_SIZE;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->used = 0;
+    ring->wrap = size;
+
+    ring->hdr->size = size;
+    aesd_ring_publish(ring);
+
+    return 0;
+}
+
+/**
+ * @return true if a line of @param len bytes can be added without releasing anything
+ */
+bool aesd_ring_fits(struct aesd_ring *ring, size_t len)
+{
+    size_t pad = 0;
+
+    // an empty ring starts over at the beginning
+    if(ring->used == 0){
+        return len <= ring->size;
+    }
+
+    if(ring->head + len > ring->size){
+        pad = ring->size - ring->head;
+    }
+
+    return ring->used + pad + len <= ring->size;
+}
+
+/**
+ * Find room for a line of @param len bytes, which must fit (see aesd_ring_fits).
+ * The line isn't visible until aesd_ring_commit is called.
+ * @return where to copy the line to
+ */
+char *aesd_ring_reserve(struct aesd_ring *ring, size_t len)
+{
+    if(ring->used == 0){
+        ring->head = 0;
+        ring->tail = 0;
+    }
+    else if(ring->head + len > ring->size){
+        // skip the end of the ring, the oldest release will reclaim it
+        ring->used += ring->size - ring->head;
+        ring->wrap = ring->head;
+        ring->head = 0;
+    }
+
+    return ring->data + ring->head;
+}
+
+/**
+ * Make the @param len byte line copied to the last reserved spot part of the ring
+ */
+void aesd_ring_commit(struct aesd_ring *ring, size_t len)
+{
+    ring->head += len;
+    ring->used += len;
+    if(ring->head == ring->size){
+        ring->wrap = ring->size;
+        ring->head = 0;
+    }
+
+    aesd_ring_publish(ring);
+}
+
+/**
+ * Release the oldest line in the ring, along with any padding after it.
+ * @param next is where the line after it starts, NULL if it was the last one
+ */
+void aesd_ring_release(struct aesd_ring *ring, const char *next)
+{
+    size_t next_offs;
+
+    if(next == NULL){
+        ring->head = 0;
+        ring->tail = 0;
+        ring->used = 0;
+        ring->wrap = ring->size;
+    }
+    else{
+        next_offs = next - ring->data;
+        ring->used -= (next_offs + ring->size - ring->tail) % ring->size;
+        ring->tail = next_offs;
+    }
+
+    aesd_ring_publish(ring);
+}
+
+/**
+ * Free the memory behind @param ring, it must not be mapped anywhere
+ */
+void aesd_ring_free(struct aesd_ring *ring)
+{
+    vfree(ring->area);
+    ring->area = NULL;
+    ring->hdr = NULL;
+    ring->data = NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ * aesd-ring.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: James Bohn
+ *
+ *  @brief Page backed ring that packs line data back to back so the whole
+ *  history can be mapped read only into user space
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#include <linux/types.h>
+#include "aesd_ioctl.h"
+
+struct aesd_ring
+{
+    /**
+     * Start of the vmalloc'd area, a header page followed by the line data
+     */
+    void *area;
+    /**
+     * Header shared with user space, lives in the first page of area
+     */
+    struct aesd_ring_header *hdr;
+    /**
+     * Line data, size bytes long
+     */
+    char *data;
+    size_t size;
+    /**
+     * Offset in data where the next line goes
+     */
+    size_t head;
+    /**
+     * Offset in data of the oldest retained line
+     */
+    size_t tail;
+    /**
+     * Bytes between tail and head, including padding skipped at the end of data
+     */
+    size_t used;
+    /**
+     * Offset in data where the lines before a wrap to the start end
+     */
+    size_t wrap;
+};
+
+extern int aesd_ring_init(struct aesd_ring *ring, size_t size);
+
+extern char *aesd_ring_reserve(struct aesd_ring *ring, size_t len);
+
+extern void aesd_ring_commit(struct aesd_ring *ring, size_t len);
+
+extern void aesd_ring_release(struct aesd_ring *ring, const char *next);
+
+extern bool aesd_ring_fits(struct aesd_ring *ring, size_t len);
+
+extern void aesd_ring_free(struct aesd_ring *ring);
+
+#endif /* AESD_RING_H */
@@ -0,0 +1,93 @@
+/*
+ * aesd-trace.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: James Bohn
+ *
+ *  @brief Tracepoints on the read, write and seek paths, enabled at runtime under
+ *  /sys/kernel/tracing/events/aesdchar/
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESD_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESD_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/**
+ * A read of @param count bytes from @param pos on device @param minor, @param ret
+ * being the # of bytes read or a negative errno
+ */
+TRACE_EVENT(aesd_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd",
+        __entry->minor, __entry->pos, __entry->count, __entry->ret)
+);
+
+/**
+ * A write of @param count bytes to device @param minor that committed @param lines
+ * whole lines, @param ret being the # of bytes taken or a negative errno
+ */
+TRACE_EVENT(aesd_write,
+    TP_PROTO(unsigned int minor, size_t count, size_t lines, ssize_t ret),
+    TP_ARGS(minor, count, lines, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(size_t, lines)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->lines = lines;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u count=%zu lines=%zu ret=%zd",
+        __entry->minor, __entry->count, __entry->lines, __entry->ret)
+);
+
+/**
+ * A move of the position on device @param minor from @param from, by llseek or
+ * AESDCHAR_IOCSEEKTO, @param ret being the new position or a negative errno
+ */
+TRACE_EVENT(aesd_seek,
+    TP_PROTO(unsigned int minor, loff_t from, loff_t ret),
+    TP_ARGS(minor, from, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, from)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->from = from;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u from=%lld ret=%lld",
+        __entry->minor, __entry->from, __entry->ret)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESD_TRACE_H_ */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd-trace
+#include <trace/define_trace.h>
@@ -33,14 +33,80 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * A batch of whole lines, stored back to back at data with the length of each in lens.
+ * Pointers are passed as 64 bit integers so the layout is the same for 32 bit callers,
+ * which the driver takes through compat_ioctl.
+ */
+struct aesd_lines {
+    uint64_t data;  // user pointer to the line bytes
+    uint64_t lens;  // user pointer to count uint32_t line lengths
+    uint64_t size;  // bytes at data: all of the lines on append, room for them on fetch
+    uint32_t index; // fetch: zero referenced entry to start at, unused on append
+    uint32_t count; // # of lines, fetch sets it to the # that were copied out
+};
+
+/**
+ * Sequence numbers of the lines retained by the device, every line committed gets
+ * one more than the line before it, starting from 0 when the driver is loaded
+ */
+struct aesd_seq_info {
+    uint64_t oldest;    // oldest line still retained, equal to next when there are none
+    uint64_t next;      // the next line committed will get this
+    uint64_t at;        // line holding this open's position, next when at the end
+};
+
+/**
+ * Header at the start of a read only mapping of the device, only available when the
+ * driver is loaded with a ring_size. The line data starts one page after the header.
+ * Lines are stored back to back from tail up to head, when tail is past head (and
+ * used isn't 0) they run from tail up to wrap and continue from the start of the data.
+ * seq is odd while the driver is changing the ring: read seq, copy out what's needed,
+ * and start over if seq was odd or has changed since.
+ */
+struct aesd_ring_header {
+    uint32_t seq;
+    uint32_t size;  // bytes of line data
+    uint32_t head;  // offset where the next line will be written
+    uint32_t tail;  // offset of the oldest line
+    uint32_t used;  // bytes from tail to head, including skipped space before a wrap
+    uint32_t wrap;  // offset where the lines before a wrap end
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the number of lines retained by the device, the oldest are dropped when shrinking
+#define AESDCHAR_IOCSETDEPTH _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Get the number of lines retained by the device
+#define AESDCHAR_IOCGETDEPTH _IOR(AESD_IOC_MAGIC, 3, uint32_t)
+// Non zero makes reads on this open of the device wait for new lines at the end
+// of the buffer (or fail with EAGAIN if O_NONBLOCK) rather than returning 0
+#define AESDCHAR_IOCSFOLLOW _IOW(AESD_IOC_MAGIC, 4, uint32_t)
+// Append a batch of lines, each ending in its only newline, with no other write landing
+// between them. Nothing is appended if any of them is bad, or if the ring the driver
+// was loaded with can't hold the whole batch at once (EFBIG).
+#define AESDCHAR_IOCAPPEND _IOW(AESD_IOC_MAGIC, 5, struct aesd_lines)
+// Copy out up to count entries starting at index, as many as fit in size bytes. Lines
+// evicted while copying end the batch early.
+#define AESDCHAR_IOCFETCH _IOWR(AESD_IOC_MAGIC, 6, struct aesd_lines)
+// Seek to the start of the line with the given sequence number, which doesn't move
+// as older lines are evicted. The next sequence number seeks to the end, and one
+// that's been evicted or is beyond that fails with ERANGE.
+#define AESDCHAR_IOCSEEKSEQ _IOW(AESD_IOC_MAGIC, 7, uint64_t)
+// Get the range of retained sequence numbers and the one at this open's position
+#define AESDCHAR_IOCGETSEQ _IOR(AESD_IOC_MAGIC, 8, struct aesd_seq_info)
+// Set the most bytes of line data retained by the device, on top of the limit on the
+// number of lines, 0 for no limit. The oldest lines are dropped to stay under it and a
+// line bigger than the whole budget can't be written (EFBIG).
+#define AESDCHAR_IOCSETBUDGET _IOW(AESD_IOC_MAGIC, 9, uint64_t)
+// Get the most bytes of line data retained by the device, 0 for no limit
+#define AESDCHAR_IOCGETBUDGET _IOR(AESD_IOC_MAGIC, 10, uint64_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 10
 
 #endif /* AESD_IOCTL_H */
@@ -9,8 +9,9 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd-ring.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,6 +26,50 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Upper bound on the number of lines a device can be asked to retain
+ */
+#define AESD_MAX_DEPTH (1 << 20)
+
+/**
+ * Upper bound on the ring_size module parameter
+ */
+#define AESD_MAX_RING_SIZE (1U << 30)
+
+/**
+ * Upper bound on the devices module parameter
+ */
+#define AESD_MAX_DEVICES 256
+
+/**
+ * Upper bounds on the lines and bytes in one AESDCHAR_IOCAPPEND or AESDCHAR_IOCFETCH
+ */
+#define AESD_MAX_BATCH 4096
+#define AESD_MAX_BATCH_SIZE (16U << 20)
+
+/**
+ * Lines are allocated from slab caches of power of two sized objects, starting
+ * at 1 << AESD_LINE_MIN_SHIFT bytes, and from kmalloc past the largest one
+ */
+#define AESD_LINE_MIN_SHIFT 6
+#define AESD_LINE_CACHES 6
+#define AESD_LINE_KMALLOC AESD_LINE_CACHES
+
+/**
+ * Running totals for a device, shown under /sys/kernel/debug/aesdchar/<minor>/stats
+ */
+struct aesd_stats
+{
+    atomic64_t bytes_written;   /* bytes taken by write, whole lines or not */
+    atomic64_t lines_written;   /* lines committed to the history */
+    atomic64_t bytes_read;
+    atomic64_t lines_read;      /* lines read through to their newline */
+    atomic64_t evictions;       /* lines dropped to make room for new ones */
+    atomic64_t lines_rejected;  /* lines too big to ever be kept */
+    atomic64_t lock_wait_ns;    /* time spent waiting on a contended dev->mtx */
+    atomic64_t alloc_failures;
+};
+
 struct aesd_dev
 {
     /**
@@ -33,10 +78,64 @@ struct aesd_dev
     struct cdev cdev;     /* Char device structure      */
 
     struct aesd_circular_buffer buf;
-    struct mutex mtx;
+    struct mutex mtx;       /* serializes writers, readers never take it */
+
+    // most bytes of line data kept in buf, the oldest lines are evicted to
+    // stay under it on top of the limit on the number of lines, 0 for none
+    size_t max_bytes;
+
+    // partial line left by an open closed before finishing it, taken up by the
+    // next write from an open with no partial line of its own (under mtx)
+    char *carry_buf;
+    size_t carry_len;
+
+    // bumped around every change to buf so readers can take a consistent copy
+    seqcount_mutex_t seq;
+
+    // keeps lines and entry arrays dropped from buf alive for readers
+    struct srcu_struct srcu;
+
+    // line storage when loaded with a ring_size, area is NULL otherwise
+    struct aesd_ring ring;
+
+    // woken whenever new lines are committed
+    wait_queue_head_t readq;
+
+    struct aesd_stats stats;
+    struct dentry *debugfs;
+};
+
+/**
+ * Storage for a line in the history when it isn't packed into the ring, the
+ * entry's buffptr points at data
+ */
+struct aesd_line
+{
+    struct rcu_head rcu;    /* frees the line once readers are done with it */
+    unsigned int cache;     /* index into the line caches, or AESD_LINE_KMALLOC */
+    char data[];
+};
+
+/**
+ * State kept for each open of the device
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool follow;    /* reads wait for new lines instead of returning end of file */
+
+    // file positions are relative to the oldest byte kept, which moves as lines
+    // are evicted, so also keep where this open is in everything ever written
+    // (see aesd_buffer_entry.start). Only good while f_pos is still fpos.
+    uint64_t pos;
+    loff_t fpos;
 
+    // line written through this open that hasn't seen its newline yet, so
+    // writers on separate opens can't interleave partial lines
+    struct mutex mtx;   /* taken before dev->mtx */
     char *line_buf;
     size_t line_len;
+    bool discard;   /* the rest of a rejected line is dropped up to its newline */
 };
 
 
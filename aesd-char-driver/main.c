@@ -18,223 +18,1250 @@
 #include <linux/syscalls.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/mm.h> // kvcalloc, vm_area_struct
+#include <linux/vmalloc.h> // remap_vmalloc_range
+#include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h> // iov_iter
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+// number of lines retained at load, can be changed later with AESDCHAR_IOCSETDEPTH
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Number of written lines retained by the device");
+
+// bytes of page backed, mmap-able line storage, 0 allocates every line separately
+static unsigned int ring_size = 0;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Bytes of mmap-able ring to pack lines into, 0 to allocate lines separately");
+
+// bytes of line data retained at load, can be changed later with AESDCHAR_IOCSETBUDGET
+static unsigned int max_bytes = 0;
+module_param(max_bytes, uint, 0444);
+MODULE_PARM_DESC(max_bytes, "Bytes of written lines retained by the device, evicting the oldest lines past it, 0 for no limit");
+
+// number of independent devices (minors), each with its own history
+static unsigned int devices = 1;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of aesdchar devices to create, each with its own line history");
+
 MODULE_AUTHOR("James Bohn");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+
+// holds a stats file per device, see aesd_stats
+static struct dentry *aesd_debugfs;
+
+/**
+ * Lock down @param dev for a writer, counting any time spent waiting on another
+ * @return 0 once locked, -ERESTART if interrupted while waiting
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+
+    // only pay for the clock when there's a wait to time
+    if(mutex_trylock(&dev->mtx)){
+        return 0;
+    }
+
+    start = ktime_get_ns();
+    if(mutex_lock_interruptible(&dev->mtx)){
+        return -ERESTART;
+    }
+    atomic64_add(ktime_get_ns() - start, &dev->stats.lock_wait_ns);
+
+    return 0;
+}
+
+// slab caches for lines up to the largest class, bigger ones use kmalloc
+static struct kmem_cache *aesd_line_caches[AESD_LINE_CACHES];
+static const char *const aesd_line_cache_names[AESD_LINE_CACHES] = {
+    "aesd_line_64", "aesd_line_128", "aesd_line_256",
+    "aesd_line_512", "aesd_line_1024", "aesd_line_2048",
+};
+
+/**
+ * @return the aesd_line holding the line data at @param data
+ */
+static struct aesd_line *aesd_line_of(const char *data)
+{
+    return (struct aesd_line *)(data - offsetof(struct aesd_line, data));
+}
+
+/**
+ * @return # of bytes of line data an object from cache class @param cache holds
+ */
+static size_t aesd_line_room(unsigned int cache)
+{
+    return (1UL << (AESD_LINE_MIN_SHIFT + cache)) - sizeof(struct aesd_line);
+}
+
+/**
+ * Allocate room for a line of @param size bytes from the smallest cache that
+ * fits it, or kmalloc if none do
+ * @return pointer to the line data, NULL on failure
+ */
+static char *aesd_line_alloc(size_t size)
+{
+    size_t total = sizeof(struct aesd_line) + size;
+    struct aesd_line *line;
+    unsigned int cache;
+
+    // objects are powers of two from 1 << AESD_LINE_MIN_SHIFT up
+    cache = (total <= (1UL << AESD_LINE_MIN_SHIFT)) ? 0 : fls64(total - 1) - AESD_LINE_MIN_SHIFT;
+    if(cache < AESD_LINE_CACHES){
+        line = kmem_cache_alloc(aesd_line_caches[cache], GFP_KERNEL);
+    }
+    else{
+        cache = AESD_LINE_KMALLOC;
+        line = kmalloc(total, GFP_KERNEL);
+    }
+
+    if(line == NULL){
+        return NULL;
+    }
+    line->cache = cache;
+    return line->data;
+}
+
+static void aesd_line_destroy(struct aesd_line *line)
+{
+    if(line->cache == AESD_LINE_KMALLOC){
+        kfree(line);
+    }
+    else{
+        kmem_cache_free(aesd_line_caches[line->cache], line);
+    }
+}
+
+/**
+ * Resize a line that isn't in the history yet, starting a new one if @param data
+ * is NULL. Only moves the line when it outgrows its object. On failure the
+ * original line is left alone.
+ * @param len # of bytes of @param data in use, carried over on a move
+ * @return pointer to the resized line data, NULL on failure
+ */
+static char *aesd_line_realloc(char *data, size_t len, size_t size)
+{
+    struct aesd_line *line;
+    char *moved;
+
+    if(data == NULL){
+        return aesd_line_alloc(size);
+    }
+
+    line = aesd_line_of(data);
+    if(line->cache == AESD_LINE_KMALLOC){
+        line = krealloc(line, sizeof(struct aesd_line) + size, GFP_KERNEL);
+        return line ? line->data : NULL;
+    }
+
+    if(size <= aesd_line_room(line->cache)){
+        return data;
+    }
+
+    moved = aesd_line_alloc(size);
+    if(moved == NULL){
+        return NULL;
+    }
+    memcpy(moved, data, len);
+    aesd_line_destroy(line);
+    return moved;
+}
+
+/**
+ * Free a line that was never in the history, NULL is ignored
+ */
+static void aesd_line_free(const char *data)
+{
+    if(data){
+        aesd_line_destroy(aesd_line_of(data));
+    }
+}
+
+static void aesd_line_free_rcu(struct rcu_head *head)
+{
+    aesd_line_destroy(container_of(head, struct aesd_line, rcu));
+}
+
+/**
+ * Free a line that has been dropped from the history once no reader can still
+ * be copying from it, NULL is ignored
+ */
+static void aesd_line_retire(struct aesd_dev *dev, const char *data)
+{
+    if(data){
+        call_srcu(&dev->srcu, &aesd_line_of(data)->rcu, aesd_line_free_rcu);
+    }
+}
+
+/**
+ * Drop the oldest line from the device's history and release its storage.
+ * Caller must hold dev->mtx.
+ */
+static void aesd_evict_oldest(struct aesd_dev *dev)
+{
+    const char *old;
+
+    write_seqcount_begin(&dev->seq);
+    old = aesd_circular_buffer_remove_entry(&dev->buf);
+    if(dev->ring.area){
+        // the ring reclaims everything up to the new oldest line
+        aesd_ring_release(&dev->ring, aesd_circular_buffer_count(&dev->buf) ?
+                dev->buf.entry[dev->buf.out_offs].buffptr : NULL);
+    }
+    write_seqcount_end(&dev->seq);
+    atomic64_inc(&dev->stats.evictions);
+
+    // ring space gets reused in place, readers check for that themselves
+    if(!dev->ring.area){
+        aesd_line_retire(dev, old);
+    }
+}
+
+/**
+ * @return the most bytes a single line written to @param dev can have, bigger
+ * ones could never be kept in the byte budget or the ring
+ */
+static size_t aesd_line_limit(struct aesd_dev *dev)
+{
+    size_t limit = READ_ONCE(dev->max_bytes);
+
+    if(limit == 0){
+        limit = SIZE_MAX;
+    }
+    if(dev->ring.area && dev->ring.size < limit){
+        limit = dev->ring.size;
+    }
+
+    return limit;
+}
+
+/**
+ * Throw away the partial line of @param file, and the rest of it up to its
+ * newline once that's written, as it's too big to ever be kept. Caller must
+ * hold file->mtx.
+ */
+static void aesd_line_reject(struct aesd_dev *dev, struct aesd_file *file)
+{
+    PDEBUG("rejecting line over %zu bytes\n", aesd_line_limit(dev));
+    aesd_line_free(file->line_buf);
+    file->line_buf = NULL;
+    file->line_len = 0;
+    file->discard = true;
+    atomic64_inc(&dev->stats.lines_rejected);
+}
+
+/**
+ * Evict the oldest lines until a new line of @param size bytes fits in the
+ * device's byte budget, if it has one. Caller must hold dev->mtx.
+ * @return 0 on success, -EFBIG if the line is bigger than the whole budget
+ */
+static int aesd_make_room(struct aesd_dev *dev, size_t size)
+{
+    if(dev->max_bytes == 0){
+        return 0;
+    }
+
+    if(size > dev->max_bytes){
+        PDEBUG("line of %zu bytes is over the byte budget\n", size);
+        return -EFBIG;
+    }
+
+    while(dev->buf.char_size + size > dev->max_bytes){
+        aesd_evict_oldest(dev);
+    }
+
+    return 0;
+}
+
+/**
+ * Pack a completed line, made of @param head_len bytes at @param head (such as a
+ * partial line held from earlier writes) followed by @param len bytes at
+ * @param data, into the ring and add it to the history. The oldest lines are
+ * evicted until it fits. Caller must hold dev->mtx.
+ * @return 0 on success, -EFBIG if the line is bigger than the whole ring
+ */
+static int aesd_ring_add_line(struct aesd_dev *dev, const char *head, size_t head_len,
+            const char *data, size_t len)
+{
+    struct aesd_buffer_entry entry;
+    char *dest;
+
+    entry.size = head_len + len;
+    if(entry.size > dev->ring.size){
+        PDEBUG("line of %zu bytes doesn't fit in the ring\n", entry.size);
+        return -EFBIG;
+    }
+
+    while(dev->buf.full || !aesd_ring_fits(&dev->ring, entry.size)){
+        aesd_evict_oldest(dev);
+    }
+
+    dest = aesd_ring_reserve(&dev->ring, entry.size);
+    if(head_len){
+        memcpy(dest, head, head_len);
+    }
+    memcpy(dest + head_len, data, len);
+
+    entry.buffptr = dest;
+    write_seqcount_begin(&dev->seq);
+    aesd_ring_commit(&dev->ring, entry.size);
+    aesd_circular_buffer_add_entry(&dev->buf, &entry);
+    write_seqcount_end(&dev->seq);
+
+    return 0;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
 
-    // save a pointer
-    filp->private_data = &aesd_device;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if(file == NULL){
+        return -ENOMEM;
+    }
+
+    // save a pointer to the device behind this minor
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file->fpos = -1;
+    mutex_init(&file->mtx);
+    filp->private_data = file;
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    char *line;
+
     PDEBUG("release");
 
-    // didn't do anything in open, don't need to do anything in release
+    // hand a partial line nobody finished to the device so a later write can
+    // finish it, as when the whole device shared one partial line
+    if(file->line_len){
+        mutex_lock(&dev->mtx);
+        if(dev->carry_len == 0){
+            dev->carry_buf = file->line_buf;
+            file->line_buf = NULL;
+        }
+        else{
+            line = aesd_line_realloc(dev->carry_buf, dev->carry_len, dev->carry_len + file->line_len);
+            if(line == NULL){
+                PDEBUG("failed to widen carry buf\n");
+                atomic64_inc(&dev->stats.alloc_failures);
+                file->line_len = 0;
+            }
+            else{
+                memcpy(line + dev->carry_len, file->line_buf, file->line_len);
+                dev->carry_buf = line;
+            }
+        }
+        WRITE_ONCE(dev->carry_len, dev->carry_len + file->line_len);
+        mutex_unlock(&dev->mtx);
+    }
+
+    aesd_line_free(file->line_buf);
+    mutex_destroy(&file->mtx);
+    kfree(file);
 
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * What aesd_lookup looks an entry up by
+ */
+enum aesd_key {
+    AESD_KEY_NONE,  // no entry, just the view
+    AESD_KEY_POS,   // the entry holding a file position
+    AESD_KEY_ABS,   // the entry holding an absolute position, see aesd_buffer_entry.start
+    AESD_KEY_INDEX, // the entry at an index, 0 being the oldest
+    AESD_KEY_SEQ,   // the entry with a sequence number
+};
+
+/**
+ * Look an entry up without taking the mutex. The lookup runs on a copy of the
+ * buffer's bookkeeping taken under dev->seq and is redone if a writer got in the
+ * way. Caller must be in a dev->srcu read section so the entry array and line
+ * stay allocated.
+ * @param view set to the bookkeeping the lookup was done on
+ * @param entry set to a copy of the entry found, may be NULL for AESD_KEY_NONE
+ * @param offset set to the offset of the position into the entry, 0 unless
+ *      looking up by AESD_KEY_POS
+ * @return true if the entry was found
+ */
+static bool aesd_lookup(struct aesd_dev *dev, enum aesd_key kind, uint64_t key,
+            struct aesd_buffer_view *view, struct aesd_buffer_entry *entry, size_t *offset)
+{
+    struct aesd_buffer_entry *found;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        aesd_circular_buffer_view(&dev->buf, view);
+        // don't walk a torn copy, the array and capacity have to match
+        if(read_seqcount_retry(&dev->seq, seq)){
+            continue;
+        }
+
+        found = NULL;
+        *offset = 0;
+        switch(kind){
+            case AESD_KEY_POS:
+                if(key < view->char_size){
+                    found = aesd_buffer_view_find_entry_offset_for_fpos(view, key, offset);
+                }
+                break;
+            case AESD_KEY_ABS:
+                if(key < view->total_size && key >= view->total_size - view->char_size){
+                    found = aesd_buffer_view_find_entry_offset_for_fpos(view,
+                        key - (view->total_size - view->char_size), offset);
+                }
+                break;
+            case AESD_KEY_INDEX:
+                if(key < view->count){
+                    found = aesd_buffer_view_get_entry(view, key);
+                }
+                break;
+            case AESD_KEY_SEQ:
+                // sequence numbers have no gaps, so it's the same as looking up by index
+                if(key < view->next_seq && key >= view->next_seq - view->count){
+                    found = aesd_buffer_view_get_entry(view, key - (view->next_seq - view->count));
+                }
+                break;
+            default:
+                break;
+        }
+        if(found){
+            *entry = *found;
+        }
+    } while(read_seqcount_retry(&dev->seq, seq));
+
+    return found != NULL;
+}
+
+/**
+ * @return the file position of absolute position @param start in @param view
+ */
+static inline loff_t aesd_view_fpos(struct aesd_buffer_view *view, uint64_t start)
+{
+    return start - (view->total_size - view->char_size);
+}
+
+/**
+ * @return the absolute position of @param file at file position @param f_pos,
+ * judged against the oldest byte in @param view if f_pos was moved by someone
+ * else or is a pread's
+ */
+static uint64_t aesd_file_pos(struct aesd_file *file, struct aesd_buffer_view *view,
+            loff_t f_pos)
+{
+    if(f_pos == file->fpos){
+        return file->pos;
+    }
+
+    return view->total_size - view->char_size + f_pos;
+}
+
+/**
+ * Move @param file to absolute position @param pos
+ * @return the file position of pos in @param view
+ */
+static loff_t aesd_file_seek(struct aesd_file *file, struct aesd_buffer_view *view,
+            uint64_t pos)
+{
+    file->pos = pos;
+    file->fpos = aesd_view_fpos(view, pos);
+    return file->fpos;
+}
+
+/**
+ * @return true if anything was written past where @param file is at @param f_pos,
+ * even if the history is full and the file size stayed the same
+ */
+static bool aesd_file_readable(struct aesd_dev *dev, struct aesd_file *file, loff_t f_pos)
 {
+    struct aesd_buffer_view view;
+    size_t offset;
+
+    aesd_lookup(dev, AESD_KEY_NONE, 0, &view, NULL, &offset);
+    return aesd_file_pos(file, &view, f_pos) < view.total_size;
+}
+
+/**
+ * Find the line holding absolute position @param pos without taking the mutex,
+ * see aesd_lookup
+ * @param view set to the bookkeeping the line was found in
+ * @param data set to the byte at pos
+ * @param avail set to the # of bytes from pos to the end of the line
+ * @param start set to the absolute start of the line (see aesd_buffer_entry)
+ * @return true if pos is in the buffer, false at the end of it or if it was evicted
+ */
+static bool aesd_find_line(struct aesd_dev *dev, uint64_t pos, struct aesd_buffer_view *view,
+            const char **data, size_t *avail, uint64_t *start)
+{
+    struct aesd_buffer_entry entry;
+    size_t offset;
+
+    if(!aesd_lookup(dev, AESD_KEY_ABS, pos, view, &entry, &offset)){
+        return false;
+    }
+
+    *data = entry.buffptr + offset;
+    *avail = entry.size - offset;
+    *start = entry.start;
+    return true;
+}
+
+/**
+ * @return true if the line starting at absolute position @param start is still
+ * in the history, meaning a ring backed copy of it made before the call is good
+ */
+static bool aesd_line_live(struct aesd_dev *dev, uint64_t start)
+{
+    struct aesd_buffer_view view;
+    size_t offset;
+
+    // the copy has to be done before looking at what's been evicted
+    smp_rmb();
+    aesd_lookup(dev, AESD_KEY_NONE, 0, &view, NULL, &offset);
+
+    return start >= view.total_size - view.char_size;
+}
+
+/**
+ * Copy lines from @param f_pos on out to @param to without taking the mutex,
+ * so readers never wait on writers or each other. Lines evicted from under
+ * @param file since its last read are skipped.
+ * @return # of bytes copied, -EFAULT if nothing could be copied
+ */
+static ssize_t aesd_read_lines(struct aesd_dev *dev, struct aesd_file *file,
+            struct iov_iter *to, loff_t *f_pos)
+{
+    struct aesd_buffer_view view;
+    size_t count = iov_iter_count(to);
     ssize_t bytes_read = 0;
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
-    size_t offset = 0;
-    struct aesd_buffer_entry *entry;
+    size_t lines_read = 0;
+    const char *data;
+    size_t copied;
+    size_t avail;
+    uint64_t start;
+    uint64_t pos;
+    size_t chunk;
+    size_t offset;
+    int idx;
+
+    idx = srcu_read_lock(&dev->srcu);
+
+    aesd_lookup(dev, AESD_KEY_NONE, 0, &view, NULL, &offset);
+    pos = aesd_file_pos(file, &view, *f_pos);
+
+    // keep copying out whole lines until the user buffer is full or we run
+    // out of data, so bulk readers don't pay a syscall per line
+    while(bytes_read < count){
+        // find the line and offset for the desired pos, stopping at the end
+        // of the buffer
+        if(!aesd_find_line(dev, pos, &view, &data, &avail, &start)){
+            // carry on from the oldest line if ours was evicted
+            if(pos < view.total_size - view.char_size){
+                pos = view.total_size - view.char_size;
+                continue;
+            }
+            break;
+        }
+
+        // only read what's left of the request if that's smaller than what's
+        // remaining on the current line
+        chunk = min_t(size_t, count - bytes_read, avail);
+
+        // actually copy the data out
+        copied = copy_to_iter(data, chunk, to);
+        if(copied != chunk){
+            PDEBUG("failed to read data into user memory\n");
+            iov_iter_revert(to, copied);
+            // report what made it out before the fault, if anything
+            if(bytes_read == 0){
+                bytes_read = -EFAULT;
+            }
+            break;
+        }
+
+        // a ring backed line can be evicted and overwritten mid copy, drop
+        // the copy if so and look the position up again
+        if(dev->ring.area && !aesd_line_live(dev, start)){
+            iov_iter_revert(to, chunk);
+            if(bytes_read){
+                break;
+            }
+            continue;
+        }
+
+        // adjust position
+        bytes_read += chunk;
+        pos += chunk;
+        if(chunk == avail){
+            lines_read++;
+        }
+    }
+
+    srcu_read_unlock(&dev->srcu, idx);
+
+    // pos can't be behind the oldest byte of the last view looked at
+    *f_pos = aesd_file_seek(file, &view, pos);
+
+    if(bytes_read > 0){
+        atomic64_add(bytes_read, &dev->stats.bytes_read);
+        atomic64_add(lines_read, &dev->stats.lines_read);
+    }
+    return bytes_read;
+}
+
+/**
+ * read_iter rather than read so splice() from the device works too, which the
+ * server uses to echo the history back without a copy through user space
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t bytes_read;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos;
+
+    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+
+    if(count == 0){
+        return 0;
+    }
+
+    pos = *f_pos;
+    do {
+        // when following the tail, wait for a line past our position instead
+        // of returning end of file. Once the history is full the relative
+        // size stops growing, so wait on everything written passing us.
+        while(file->follow && !aesd_file_readable(dev, file, *f_pos)){
+            if((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)){
+                bytes_read = -EAGAIN;
+                goto out;
+            }
+
+            if(wait_event_interruptible(dev->readq, aesd_file_readable(dev, file, *f_pos))){
+                bytes_read = -ERESTARTSYS;
+                goto out;
+            }
+        }
+
+        bytes_read = aesd_read_lines(dev, file, to, f_pos);
+    } while(bytes_read == 0 && file->follow);
+
+  out:
+    trace_aesd_read(MINOR(dev->cdev.dev), pos, count, bytes_read);
+    return bytes_read;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_view view;
+    size_t size;
+    size_t offset;
+    uint64_t oldest;
+    uint64_t cur;
+    loff_t from = filp->f_pos;
+	loff_t newpos;
+
+    PDEBUG("seek with offset %lld and whence %d",off,whence);
+
+    // only the sizes are needed, no entry to keep around
+    aesd_lookup(dev, AESD_KEY_NONE, 0, &view, NULL, &offset);
+    size = view.char_size;
+    oldest = view.total_size - size;
+
+	switch(whence) {
+	  case 0: /* SEEK_SET */
+		newpos = off;
+		break;
+
+	  case 1: /* SEEK_CUR */
+		// from where this open really is, if lines were evicted since
+		cur = aesd_file_pos(file, &view, filp->f_pos);
+		newpos = (cur > oldest ? cur - oldest : 0) + off;
+		break;
+
+	  case 2: /* SEEK_END */
+		newpos = size + off;
+		break;
+
+	  default: /* can't happen */
+		newpos = -EINVAL;
+		goto out;
+	}
+
+    // return if new position would be invalid (or underflow)
+    if(newpos < 0 || newpos > size){
+        newpos = -EINVAL;
+        goto out;
+    }
+
+    // set the new position
+    filp->f_pos = aesd_file_seek(file, &view, oldest + newpos);
+
+  out:
+    trace_aesd_seek(MINOR(dev->cdev.dev), from, newpos);
+    return newpos;
+}
+
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    ssize_t retval = -ENOMEM;
+    size_t bytes_written = 0;
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry entry;
+    const char *old;
+    char *kbuf;
+    char *line;
+    char *new_line;
+    size_t len;
+    size_t lines = 0;
+    bool locked = false;
+    int rc;
 
     if(buf == NULL || f_pos == NULL){
-        PDEBUG("invalid pointer input to read\n");
+        PDEBUG("invalid pointer input to write\n");
         return -EINVAL;
     }
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("write %zu bytes with offset %lld\n",count,*f_pos);
 
     if(count == 0){
         return 0;
     }
 
-    if(mutex_lock_interruptible(&dev->mtx)){
+    // pull the whole write into kernel space in one go, before taking the
+    // lock since a fault here can sleep
+    kbuf = aesd_line_alloc(count);
+    if(kbuf == NULL){
+        PDEBUG("failed to create write buf\n");
+        atomic64_inc(&dev->stats.alloc_failures);
+        return -ENOMEM;
+    }
+
+    if(copy_from_user(kbuf, buf, count)){
+        PDEBUG("failed to read from user space\n");
+        aesd_line_free(kbuf);
+        return -EFAULT;
+    }
+
+    // lock down this open's partial line, writers on other opens carry on
+    if(mutex_lock_interruptible(&file->mtx)){
+        aesd_line_free(kbuf);
         return -ERESTART;
     }
 
-    // find the line and offset for the desired pos
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buf, *f_pos, &offset);
+    // the device only needs locking to commit complete lines, a write that
+    // just extends the partial line never touches it
+    new_line = memchr(kbuf, '\n', count);
+    if(new_line || (file->line_len == 0 && READ_ONCE(dev->carry_len))){
+        rc = aesd_lock(dev);
+        if(rc){
+            retval = rc;
+            goto out;
+        }
+        locked = true;
+    }
 
-    // If an entry isn't found, (offset too big) we've reached the end of the buffer
-    // and can't read anything
-    if(entry == NULL){
-        mutex_unlock(&dev->mtx);
-        return 0;
+    // take up a partial line left by a closed open
+    if(locked && file->line_len == 0 && dev->carry_len){
+        file->line_buf = dev->carry_buf;
+        file->line_len = dev->carry_len;
+        dev->carry_buf = NULL;
+        WRITE_ONCE(dev->carry_len, 0);
+    }
+
+    // commit every complete line in the write
+    while(new_line){
+        len = new_line + 1 - (kbuf + bytes_written);
+
+        // the rest of a rejected line goes with it
+        if(file->discard){
+            file->discard = false;
+            bytes_written += len;
+            new_line = memchr(kbuf + bytes_written, '\n', count - bytes_written);
+            continue;
+        }
+
+        // a line that could never be kept is dropped, partial line and all, so
+        // it can't hold up the lines after it. The write it's in fails unless
+        // lines went in ahead of it, the next write reports it then.
+        if(file->line_len + len > aesd_line_limit(dev)){
+            if(bytes_written == 0){
+                aesd_line_reject(dev, file);
+                file->discard = false;
+                retval = -EFBIG;
+            }
+            goto out;
+        }
+
+        rc = aesd_make_room(dev, file->line_len + len);
+        if(rc){
+            retval = rc;
+            goto out;
+        }
+
+        if(dev->ring.area){
+            rc = aesd_ring_add_line(dev, file->line_buf, file->line_len,
+                    kbuf + bytes_written, len);
+            if(rc){
+                retval = rc;
+                goto out;
+            }
+            aesd_line_free(file->line_buf);
+            file->line_buf = NULL;
+            file->line_len = 0;
+        }
+        else{
+            if(file->line_len){
+                // finish the line started by earlier writes in place
+                line = aesd_line_realloc(file->line_buf, file->line_len, file->line_len + len);
+                if(line == NULL){
+                    PDEBUG("failed to widen line buf\n");
+                    atomic64_inc(&dev->stats.alloc_failures);
+                    goto out;
+                }
+                memcpy(line + file->line_len, kbuf + bytes_written, len);
+                entry.size = file->line_len + len;
+                file->line_buf = NULL;
+                file->line_len = 0;
+            }
+            else if(len == count){
+                // the write is exactly one line, hand over the buffer it's
+                // already sitting in
+                line = kbuf;
+                kbuf = NULL;
+                entry.size = len;
+            }
+            else{
+                line = aesd_line_alloc(len);
+                if(line == NULL){
+                    PDEBUG("failed to create entry\n");
+                    atomic64_inc(&dev->stats.alloc_failures);
+                    goto out;
+                }
+                memcpy(line, kbuf + bytes_written, len);
+                entry.size = len;
+            }
+
+            // add new entry to buffer and free old entry if overwritten, once
+            // readers are done with it (nothing happens if it returns NULL)
+            entry.buffptr = line;
+            write_seqcount_begin(&dev->seq);
+            old = aesd_circular_buffer_add_entry(&dev->buf, &entry);
+            write_seqcount_end(&dev->seq);
+            if(old){
+                atomic64_inc(&dev->stats.evictions);
+                aesd_line_retire(dev, old);
+            }
+        }
+
+        bytes_written += len;
+        lines++;
+        if(kbuf == NULL){
+            break;
+        }
+        new_line = memchr(kbuf + bytes_written, '\n', count - bytes_written);
     }
 
-    // only read count bytes if that's smaller than what's remaining on the 
-    // current line
-    bytes_read = min(count, entry->size - offset);
+    // hold on to a trailing partial line until a later write finishes it,
+    // unless it's already too big to keep
+    if(bytes_written < count && file->discard){
+        // more of a rejected line
+        bytes_written = count;
+    }
+    else if(bytes_written < count){
+        len = count - bytes_written;
+        if(file->line_len + len > aesd_line_limit(dev)){
+            if(bytes_written == 0){
+                aesd_line_reject(dev, file);
+                retval = -EFBIG;
+            }
+            goto out;
+        }
+        else if(file->line_len == 0 && len == count){
+            file->line_buf = kbuf;
+            kbuf = NULL;
+        }
+        else{
+            line = aesd_line_realloc(file->line_buf, file->line_len, file->line_len + len);
+            if(line == NULL){
+                PDEBUG("failed to widen line buf\n");
+                atomic64_inc(&dev->stats.alloc_failures);
+                goto out;
+            }
+            memcpy(line + file->line_len, kbuf + bytes_written, len);
+            file->line_buf = line;
+        }
+        file->line_len += len;
+        bytes_written = count;
+    }
 
-    // actually copy the data out
-    if(copy_to_user(buf, entry->buffptr+offset, bytes_read)){
-        PDEBUG("failed to read data into user memory\n");
+  out:
+    if(locked){
         mutex_unlock(&dev->mtx);
-        return -EFAULT;
+    }
+    mutex_unlock(&file->mtx);
+    aesd_line_free(kbuf);
+
+    // let readers waiting on new lines know
+    if(lines){
+        wake_up_interruptible(&dev->readq);
+        atomic64_add(lines, &dev->stats.lines_written);
+    }
+
+    // lines committed before a failure still count as written
+    if(bytes_written > 0){
+        retval = bytes_written;
+        atomic64_add(bytes_written, &dev->stats.bytes_written);
     }
 
-    // adjust position
-    *f_pos += bytes_read;
+    trace_aesd_write(MINOR(dev->cdev.dev), count, lines, retval);
+    return retval;
+}
+
+/**
+ * @return true if the @param len bytes at @param line are a single whole line,
+ * ending in its only newline
+ */
+static bool aesd_line_valid(const char *line, size_t len)
+{
+    return len > 0 && line[len - 1] == '\n' && memchr(line, '\n', len - 1) == NULL;
+}
+
+/**
+ * Check that a batch of @param count lines of @param lens bytes can be packed
+ * into the ring after what's already there without the later lines evicting the
+ * earlier ones, which padding at the end of the ring can make happen even when
+ * the batch is smaller than the ring. Runs the adds on a copy of the ring.
+ * Caller must hold dev->mtx.
+ */
+static bool aesd_ring_batch_fits(struct aesd_dev *dev, const uint32_t *lens, uint32_t count)
+{
+    struct aesd_ring_header hdr;
+    struct aesd_ring sim = dev->ring;
+    size_t stored = aesd_circular_buffer_count(&dev->buf);
+    size_t released = 0;
+    const char *first = NULL;
+    const char *next;
+    uint32_t i;
+
+    // keep the copy's header updates away from user space
+    sim.hdr = &hdr;
+
+    for(i = 0; i < count; i++){
+        while(!aesd_ring_fits(&sim, lens[i])){
+            // only lines from before the batch may go
+            if(released == stored){
+                return false;
+            }
+            released++;
+            next = (released < stored) ?
+                aesd_circular_buffer_get_entry(&dev->buf, released)->buffptr : first;
+            aesd_ring_release(&sim, next);
+        }
+
+        next = aesd_ring_reserve(&sim, lens[i]);
+        if(i == 0){
+            first = next;
+        }
+        aesd_ring_commit(&sim, lens[i]);
+    }
+
+    return true;
+}
+
+/**
+ * Append the batch of lines described by @param req to the history with no
+ * other write landing between them. Every line is checked and copied in before
+ * the lock is taken, so either all of them are added or none are.
+ * @return 0 on success, negative errno on failure
+ */
+static int aesd_append_lines(struct aesd_dev *dev, const struct aesd_lines *req)
+{
+    const char __user *data = u64_to_user_ptr(req->data);
+    struct aesd_buffer_entry entry;
+    const char **lines = NULL;
+    uint32_t *lens;
+    char *kbuf = NULL;
+    char *line;
+    size_t off;
+    uint32_t n = 0;
+    uint32_t i;
+    uint32_t added;
+    int rc = 0;
+
+    if(req->count == 0 || req->count > AESD_MAX_BATCH || req->size > AESD_MAX_BATCH_SIZE){
+        return -EINVAL;
+    }
+
+    lens = kvmalloc_array(req->count, sizeof(uint32_t), GFP_KERNEL);
+    if(lens == NULL){
+        atomic64_inc(&dev->stats.alloc_failures);
+        return -ENOMEM;
+    }
+
+    if(copy_from_user(lens, u64_to_user_ptr(req->lens), req->count * sizeof(uint32_t))){
+        rc = -EFAULT;
+        goto out;
+    }
+
+    // the lengths have to cover exactly the bytes handed over
+    for(i = 0, off = 0; i < req->count; i++){
+        if(lens[i] == 0 || lens[i] > req->size - off){
+            rc = -EINVAL;
+            goto out;
+        }
+        off += lens[i];
+    }
+    if(off != req->size){
+        rc = -EINVAL;
+        goto out;
+    }
+
+    if(dev->ring.area){
+        // packed straight from one copy of the batch once locked
+        if(req->size > dev->ring.size){
+            rc = -EFBIG;
+            goto out;
+        }
+
+        kbuf = kvmalloc(req->size, GFP_KERNEL);
+        if(kbuf == NULL){
+            atomic64_inc(&dev->stats.alloc_failures);
+            rc = -ENOMEM;
+            goto out;
+        }
+
+        if(copy_from_user(kbuf, data, req->size)){
+            rc = -EFAULT;
+            goto out;
+        }
+
+        for(i = 0, off = 0; i < req->count; off += lens[i], i++){
+            if(!aesd_line_valid(kbuf + off, lens[i])){
+                rc = -EINVAL;
+                goto out;
+            }
+        }
+    }
+    else{
+        // copy each line straight into its own storage
+        lines = kvmalloc_array(req->count, sizeof(char *), GFP_KERNEL);
+        if(lines == NULL){
+            atomic64_inc(&dev->stats.alloc_failures);
+            rc = -ENOMEM;
+            goto out;
+        }
 
-    mutex_unlock(&dev->mtx);
-    return bytes_read;
-}
+        for(off = 0; n < req->count; off += lens[n], n++){
+            line = aesd_line_alloc(lens[n]);
+            if(line == NULL){
+                atomic64_inc(&dev->stats.alloc_failures);
+                rc = -ENOMEM;
+                goto out;
+            }
+            lines[n] = line;
 
-loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
-    struct aesd_dev *dev = filp->private_data;
-	loff_t newpos;
+            if(copy_from_user(line, data + off, lens[n])){
+                n++;
+                rc = -EFAULT;
+                goto out;
+            }
 
-    PDEBUG("seek with offset %lld and whence %d",off,whence);
+            if(!aesd_line_valid(line, lens[n])){
+                n++;
+                rc = -EINVAL;
+                goto out;
+            }
+        }
+    }
 
     // lock it down
-    if(mutex_lock_interruptible(&dev->mtx)){
-        return -ERESTART;
+    rc = aesd_lock(dev);
+    if(rc){
+        goto out;
     }
 
-	switch(whence) {
-	  case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	  case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	  case 2: /* SEEK_END */
-		newpos = dev->buf.char_size + off;
-		break;
-
-	  default: /* can't happen */
+    // a batch that would push out its own lines can't be appended whole
+    if(req->count > dev->buf.capacity){
         mutex_unlock(&dev->mtx);
-		return -EINVAL;
-	}
+        rc = -EINVAL;
+        goto out;
+    }
 
-    // return if new position would be invalid (or underflow)
-    if(newpos > dev->buf.char_size){
+    // make room for the whole batch up front, in its own right it only
+    // evicts by count
+    rc = aesd_make_room(dev, req->size);
+    if(rc){
         mutex_unlock(&dev->mtx);
-        return -EINVAL;
+        goto out;
     }
 
-    // set the new position
-    filp->f_pos = newpos;
+    if(dev->ring.area){
+        // it's not enough for the batch to be smaller than the ring, padding
+        // skipped at its end can make a line push out an earlier one
+        if(!aesd_ring_batch_fits(dev, lens, req->count)){
+            mutex_unlock(&dev->mtx);
+            rc = -EFBIG;
+            goto out;
+        }
+
+        for(i = 0, off = 0; i < req->count; off += lens[i], i++){
+            rc = aesd_ring_add_line(dev, NULL, 0, kbuf + off, lens[i]);
+            if(rc){
+                break;
+            }
+        }
+        added = i;
+    }
+    else{
+        // readers see the whole batch land at once, the lines it overwrites
+        // take the place of the added ones to be retired below
+        write_seqcount_begin(&dev->seq);
+        for(i = 0; i < req->count; i++){
+            entry.buffptr = lines[i];
+            entry.size = lens[i];
+            lines[i] = aesd_circular_buffer_add_entry(&dev->buf, &entry);
+        }
+        write_seqcount_end(&dev->seq);
+        added = req->count;
+    }
 
     mutex_unlock(&dev->mtx);
 
-    return newpos;
+    for(i = 0; i < n; i++){
+        if(lines[i]){
+            atomic64_inc(&dev->stats.evictions);
+            aesd_line_retire(dev, lines[i]);
+        }
+    }
+    n = 0;
+
+    // let readers waiting on new lines know, off being the bytes added
+    if(added){
+        wake_up_interruptible(&dev->readq);
+        atomic64_add(added, &dev->stats.lines_written);
+        atomic64_add(off, &dev->stats.bytes_written);
+    }
+
+  out:
+    // lines that never made it into the history
+    for(i = 0; i < n; i++){
+        aesd_line_free(lines[i]);
+    }
+    kvfree(lines);
+    kvfree(kbuf);
+    kvfree(lens);
+    return rc;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Copy out the entries described by @param req without taking the mutex,
+ * setting req->count to the # copied. The batch ends early at a gap left by
+ * lines evicted since the first one was copied.
+ * @return 0 on success, -EMSGSIZE if the first line doesn't fit in req->size,
+ * other negative errno on failure
+ */
+static int aesd_fetch_lines(struct aesd_dev *dev, struct aesd_lines *req)
 {
-    ssize_t bytes_written = 0;
-    const char *buf_to_free;
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
-
-    if(buf == NULL || f_pos == NULL){
-        PDEBUG("invalid pointer input to write\n");
+    char __user *data = u64_to_user_ptr(req->data);
+    uint32_t __user *lens = u64_to_user_ptr(req->lens);
+    struct aesd_buffer_view view;
+    struct aesd_buffer_entry entry;
+    size_t offset;
+    uint64_t next = 0;
+    size_t off = 0;
+    uint32_t n = 0;
+    int rc = 0;
+    int idx;
+
+    if(req->count > AESD_MAX_BATCH){
         return -EINVAL;
     }
 
-    PDEBUG("write %zu bytes with offset %lld\n",count,*f_pos);
-
-    if(count == 0){
-        return 0;
-    }
+    idx = srcu_read_lock(&dev->srcu);
 
-    // lock it down
-    if(mutex_lock_interruptible(&dev->mtx)){
-        return -ERESTART;
-    }
+    while(n < req->count){
+        // stop at the end of the buffer, or if eviction shifted the entries
+        // since the last line so this one doesn't follow it
+        if(!aesd_lookup(dev, AESD_KEY_INDEX, (uint64_t)req->index + n, &view, &entry, &offset) ||
+                (n > 0 && entry.start != next)){
+            break;
+        }
 
-    // Allocate kernel memory for incoming data (expand or create line buf)
-    if(dev->line_len){
-        // line already started
-        dev->line_buf = krealloc(dev->line_buf, dev->line_len + count, GFP_KERNEL);
-        if(dev->line_buf == NULL){
-            PDEBUG("failed to widen line buf\n");
-            mutex_unlock(&dev->mtx);
-            return -ENOMEM;
+        if(entry.size > req->size - off){
+            if(n == 0){
+                rc = -EMSGSIZE;
+            }
+            break;
         }
-    }
-    else{
-        // brand new line
-        dev->line_buf = kmalloc(count, GFP_KERNEL);
-        if(dev->line_buf == NULL){
-            PDEBUG("failed to create line buf\n");
-            mutex_unlock(&dev->mtx);
-            return -ENOMEM;
+
+        if(copy_to_user(data + off, entry.buffptr, entry.size) ||
+                put_user((uint32_t)entry.size, lens + n)){
+            rc = -EFAULT;
+            break;
         }
-    }
 
-    // loop through write data and handle complete lines as they come
-    while(bytes_written < count){
-        if(get_user(dev->line_buf[dev->line_len++], &buf[bytes_written++])){
-            PDEBUG("failed to read from user space\n");
-            mutex_unlock(&dev->mtx);
-            return -EFAULT;
-        }
-
-        // check if we just found the end of a line
-        if(dev->line_buf[dev->line_len - 1] == '\n'){
-            // allocate a new entry
-            struct aesd_buffer_entry entry;
-            entry.buffptr = kmalloc(dev->line_len, GFP_KERNEL);
-            entry.size = dev->line_len;
-            if(entry.buffptr == NULL){
-                PDEBUG("failed to create entry\n");
-                mutex_unlock(&dev->mtx);
-                return -ENOMEM; 
-            }
-
-            // copy line into new entry (all in kernel space)
-            memcpy((void *)entry.buffptr, dev->line_buf, dev->line_len);
-
-            // add new entry to buffer and free old entry if overwritten
-            // (if nothing was overwritten it will call kfree(NULL))
-            buf_to_free = aesd_circular_buffer_add_entry(&dev->buf, &entry);
-            kfree(buf_to_free);
-
-            // free the old line buf since we no longer need any already
-            // written data
-            kfree(dev->line_buf);
-            dev->line_len = 0;
-
-            // only allocate more space if necessary
-            if(bytes_written < count){
-                dev->line_buf = kmalloc(count - bytes_written, GFP_KERNEL);
-                if(dev->line_buf == NULL){
-                    PDEBUG("failed to widen line buf\n");
-                    mutex_unlock(&dev->mtx);
-                    return -ENOMEM;
-                }  
+        // a ring backed line can be evicted and overwritten mid copy, start
+        // over if it was the first one, or end the batch before it
+        if(dev->ring.area && !aesd_line_live(dev, entry.start)){
+            if(n > 0){
+                break;
             }
+            continue;
         }
+
+        next = entry.start + entry.size;
+        off += entry.size;
+        n++;
     }
 
-    mutex_unlock(&dev->mtx);
-    return bytes_written;
+    srcu_read_unlock(&dev->srcu, idx);
+
+    req->count = n;
+    return rc;
 }
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
-    struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    // lockless lookups, see aesd_lookup
+    struct aesd_buffer_view view;
+    struct aesd_buffer_entry entry;
+    size_t offset;
+    bool found;
+    int idx;
 
     if(_IOC_TYPE(cmd) != AESD_IOC_MAGIC){
         return -EINVAL;
@@ -245,7 +1272,7 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     switch(cmd){
         case AESDCHAR_IOCSEEKTO:;
             struct aesd_seekto kcmd;
-            ssize_t newpos;
+            loff_t newpos = -1;
 
             // bring the command into kernel space
             if(copy_from_user(&kcmd, (const void __user *)arg, sizeof(struct aesd_seekto))){
@@ -254,22 +1281,199 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 
             PDEBUG("ioctl seekto with entry %u and offset %u",kcmd.write_cmd,kcmd.write_cmd_offset);
 
-            // lock it down
-            if(mutex_lock_interruptible(&dev->mtx)){
+            // look it up locklessly rather than locking the buffer down, the
+            // srcu section keeps the entry array around
+            idx = srcu_read_lock(&dev->srcu);
+            if(aesd_lookup(dev, AESD_KEY_INDEX, kcmd.write_cmd, &view, &entry, &offset) &&
+                    kcmd.write_cmd_offset < entry.size){
+                newpos = aesd_view_fpos(&view, entry.start) + kcmd.write_cmd_offset;
+            }
+            srcu_read_unlock(&dev->srcu, idx);
+
+            if(newpos < 0){
+                trace_aesd_seek(MINOR(dev->cdev.dev), filp->f_pos, -EINVAL);
+                return -EINVAL;
+            }
+
+            trace_aesd_seek(MINOR(dev->cdev.dev), filp->f_pos, newpos);
+            filp->f_pos = aesd_file_seek(file, &view, entry.start + kcmd.write_cmd_offset);
+            break;
+        case AESDCHAR_IOCSETDEPTH:;
+            struct aesd_buffer_entry *entries;
+            uint32_t depth;
+
+            if(get_user(depth, (uint32_t __user *)arg)){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl setdepth to %u entries",depth);
+
+            if(depth == 0 || depth > AESD_MAX_DEPTH){
+                return -EINVAL;
+            }
+
+            // allocate outside the lock, the buffer is only touched below
+            entries = kvcalloc(depth, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+            if(entries == NULL){
+                atomic64_inc(&dev->stats.alloc_failures);
+                return -ENOMEM;
+            }
+
+            if(aesd_lock(dev)){
+                kvfree(entries);
                 return -ERESTART;
             }
 
-            newpos = aesd_circular_buffer_find_fpos_for_entry_offset(&dev->buf, kcmd.write_cmd, kcmd.write_cmd_offset);
+            // drop the oldest lines that no longer fit
+            while(aesd_circular_buffer_count(&dev->buf) > depth){
+                aesd_evict_oldest(dev);
+            }
+
+            write_seqcount_begin(&dev->seq);
+            entries = aesd_circular_buffer_set_storage(&dev->buf, entries, depth);
+            write_seqcount_end(&dev->seq);
 
-            if(newpos < 0){
-                mutex_unlock(&dev->mtx);
+            mutex_unlock(&dev->mtx);
+
+            // free the array that was replaced once no reader can be looking
+            // at it
+            if(entries){
+                synchronize_srcu(&dev->srcu);
+                kvfree(entries);
+            }
+            break;
+        case AESDCHAR_IOCSFOLLOW:;
+            uint32_t follow;
+
+            if(get_user(follow, (uint32_t __user *)arg)){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl follow %u",follow);
+
+            // only this open of the device changes behavior
+            file->follow = (follow != 0);
+            break;
+        case AESDCHAR_IOCGETDEPTH:
+            // a single aligned read, no need to lock
+            if(put_user((uint32_t)READ_ONCE(dev->buf.capacity), (uint32_t __user *)arg)){
+                return -EFAULT;
+            }
+            break;
+        case AESDCHAR_IOCAPPEND:;
+            struct aesd_lines append;
+
+            if(copy_from_user(&append, (const void __user *)arg, sizeof(struct aesd_lines))){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl append %u lines of %llu bytes",append.count,append.size);
+
+            return aesd_append_lines(dev, &append);
+        case AESDCHAR_IOCFETCH:;
+            struct aesd_lines fetch;
+            int rc;
+
+            if(copy_from_user(&fetch, (const void __user *)arg, sizeof(struct aesd_lines))){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl fetch %u lines from entry %u",fetch.count,fetch.index);
+
+            rc = aesd_fetch_lines(dev, &fetch);
+            if(rc){
+                return rc;
+            }
+
+            // report how many lines made it out
+            if(put_user(fetch.count, &((struct aesd_lines __user *)arg)->count)){
+                return -EFAULT;
+            }
+            break;
+        case AESDCHAR_IOCSETBUDGET:;
+            uint64_t budget;
+
+            if(get_user(budget, (uint64_t __user *)arg)){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl setbudget to %llu bytes",budget);
+
+            if(budget > SIZE_MAX){
                 return -EINVAL;
             }
 
-            filp->f_pos = newpos;
+            if(aesd_lock(dev)){
+                return -ERESTART;
+            }
+
+            // drop the oldest lines that no longer fit
+            WRITE_ONCE(dev->max_bytes, budget);
+            if(budget){
+                while(dev->buf.char_size > budget){
+                    aesd_evict_oldest(dev);
+                }
+            }
 
             mutex_unlock(&dev->mtx);
             break;
+        case AESDCHAR_IOCGETBUDGET:
+            // a single aligned read, no need to lock
+            if(put_user((uint64_t)READ_ONCE(dev->max_bytes), (uint64_t __user *)arg)){
+                return -EFAULT;
+            }
+            break;
+        case AESDCHAR_IOCSEEKSEQ:;
+            uint64_t target;
+            loff_t seqpos;
+
+            if(get_user(target, (uint64_t __user *)arg)){
+                return -EFAULT;
+            }
+
+            PDEBUG("ioctl seekseq to line %llu",target);
+
+            // same as AESDCHAR_IOCSEEKTO, the next sequence # being the end
+            idx = srcu_read_lock(&dev->srcu);
+            found = aesd_lookup(dev, AESD_KEY_SEQ, target, &view, &entry, &offset);
+            srcu_read_unlock(&dev->srcu, idx);
+            if(!found){
+                // the end of the buffer
+                entry.start = view.total_size;
+            }
+            seqpos = (found || target == view.next_seq) ? aesd_view_fpos(&view, entry.start) : -1;
+
+            if(seqpos < 0){
+                trace_aesd_seek(MINOR(dev->cdev.dev), filp->f_pos, -ERANGE);
+                return -ERANGE;
+            }
+
+            trace_aesd_seek(MINOR(dev->cdev.dev), filp->f_pos, seqpos);
+            filp->f_pos = aesd_file_seek(file, &view, entry.start);
+            break;
+        case AESDCHAR_IOCGETSEQ:;
+            struct aesd_seq_info info;
+            uint64_t pos;
+
+            // where this open is, the next read skipping to the oldest line
+            // if its own was evicted
+            idx = srcu_read_lock(&dev->srcu);
+            aesd_lookup(dev, AESD_KEY_NONE, 0, &view, NULL, &offset);
+            pos = aesd_file_pos(file, &view, filp->f_pos);
+            if(pos < view.total_size - view.char_size){
+                pos = view.total_size - view.char_size;
+            }
+            found = aesd_lookup(dev, AESD_KEY_ABS, pos, &view, &entry, &offset);
+            srcu_read_unlock(&dev->srcu, idx);
+
+            info.oldest = view.next_seq - view.count;
+            info.next = view.next_seq;
+            info.at = found ? entry.seq : view.next_seq;
+
+            if(copy_to_user((void __user *)arg, &info, sizeof(struct aesd_seq_info))){
+                return -EFAULT;
+            }
+            break;
         default:
             return -ENOTTY;
             break;
@@ -278,19 +1482,113 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     return 0;
 }
 
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    // readable once there's data past this open's position
+    if(aesd_file_readable(dev, file, filp->f_pos)){
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return mask;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+
+    PDEBUG("mmap %lu bytes from page %lu",vma->vm_end - vma->vm_start,vma->vm_pgoff);
+
+    // only the ring can be mapped
+    if(dev->ring.area == NULL){
+        return -ENODEV;
+    }
+
+    // the ring is only ever written by the driver
+    if(vma->vm_flags & VM_WRITE){
+        return -EACCES;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    // maps the header page and line data, refusing anything past the end
+    return remap_vmalloc_range(vma, dev->ring.area, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =            THIS_MODULE,
-    .read =             aesd_read,
+    .read_iter =        aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =      copy_splice_read,
+#else
+    .splice_read =      generic_file_splice_read,
+#endif
     .write =            aesd_write,
     .llseek =           aesd_llseek,
     .unlocked_ioctl =   aesd_ioctl,
+    // every argument is a pointer to a struct laid out the same for 32 bit callers
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl =     compat_ptr_ioctl,
+#else
+    .compat_ioctl =     aesd_ioctl,
+#endif
+    .poll =             aesd_poll,
+    .mmap =             aesd_mmap,
     .open =             aesd_open,
     .release =          aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/**
+ * Show the running totals and current occupancy of the device behind a stats file
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats *stats = &dev->stats;
+    size_t lines, bytes, depth, ring_used;
+
+    // occupancy is read together so it adds up
+    if(mutex_lock_interruptible(&dev->mtx)){
+        return -ERESTART;
+    }
+    lines = aesd_circular_buffer_count(&dev->buf);
+    bytes = dev->buf.char_size;
+    depth = dev->buf.capacity;
+    ring_used = dev->ring.used;
+    mutex_unlock(&dev->mtx);
+
+    seq_printf(s, "bytes_written: %lld\n", atomic64_read(&stats->bytes_written));
+    seq_printf(s, "lines_written: %lld\n", atomic64_read(&stats->lines_written));
+    seq_printf(s, "bytes_read: %lld\n", atomic64_read(&stats->bytes_read));
+    seq_printf(s, "lines_read: %lld\n", atomic64_read(&stats->lines_read));
+    seq_printf(s, "evictions: %lld\n", atomic64_read(&stats->evictions));
+    seq_printf(s, "lines_rejected: %lld\n", atomic64_read(&stats->lines_rejected));
+    seq_printf(s, "lock_wait_ns: %lld\n", atomic64_read(&stats->lock_wait_ns));
+    seq_printf(s, "alloc_failures: %lld\n", atomic64_read(&stats->alloc_failures));
+    seq_printf(s, "lines: %zu\n", lines);
+    seq_printf(s, "bytes: %zu\n", bytes);
+    seq_printf(s, "depth: %zu\n", depth);
+    seq_printf(s, "max_bytes: %zu\n", READ_ONCE(dev->max_bytes));
+    if(dev->ring.area){
+        seq_printf(s, "ring_used: %zu\n", ring_used);
+        seq_printf(s, "ring_size: %zu\n", dev->ring.size);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -302,30 +1600,184 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     return err;
 }
 
+static void aesd_line_caches_destroy(void)
+{
+    unsigned int i;
+
+    for(i = 0; i < AESD_LINE_CACHES; i++){
+        kmem_cache_destroy(aesd_line_caches[i]);
+        aesd_line_caches[i] = NULL;
+    }
+}
+
+/**
+ * Create the slab caches lines are allocated from, shared by every device
+ * @return 0 on success, -ENOMEM with nothing left created on failure
+ */
+static int aesd_line_caches_create(void)
+{
+    unsigned int i;
+
+    for(i = 0; i < AESD_LINE_CACHES; i++){
+        aesd_line_caches[i] = kmem_cache_create(aesd_line_cache_names[i],
+                1U << (AESD_LINE_MIN_SHIFT + i), 0, 0, NULL);
+        if(aesd_line_caches[i] == NULL){
+            aesd_line_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Set up the line history of a single device, before its cdev is added
+ * @return 0 on success, negative errno on failure with nothing left allocated
+ */
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entries;
+    int result;
+
+    mutex_init(&dev->mtx);
+    seqcount_mutex_init(&dev->seq, &dev->mtx);
+    dev->max_bytes = max_bytes;
+    init_waitqueue_head(&dev->readq);
+    result = init_srcu_struct(&dev->srcu);
+    if(result){
+        return result;
+    }
+
+    // give the buffer room for the requested history
+    aesd_circular_buffer_init(&dev->buf);
+    entries = kvcalloc(max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if(entries == NULL){
+        cleanup_srcu_struct(&dev->srcu);
+        return -ENOMEM;
+    }
+    aesd_circular_buffer_set_storage(&dev->buf, entries, max_entries);
+
+    // pack lines into a mappable ring if asked to
+    if(ring_size){
+        result = aesd_ring_init(&dev->ring, ring_size);
+        if(result){
+            kvfree(entries);
+            cleanup_srcu_struct(&dev->srcu);
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free everything aesd_dev_init set up and any lines written since, after the
+ * device's cdev is gone
+ */
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    size_t i;
+
+    // let lines that were already retired finish freeing
+    srcu_barrier(&dev->srcu);
+
+    // lines either all live in the ring or were allocated one by one
+    if(dev->ring.area){
+        aesd_ring_free(&dev->ring);
+    }
+    else{
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buf, i){
+            if(entry->size > 0){
+                aesd_line_free(entry->buffptr);
+            }
+        }
+    }
+
+    kvfree(dev->buf.entry);
+    aesd_line_free(dev->carry_buf);
 
+    cleanup_srcu_struct(&dev->srcu);
+    mutex_destroy(&dev->mtx);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    char name[16];
+    unsigned int i;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if(max_entries == 0 || max_entries > AESD_MAX_DEPTH){
+        printk(KERN_WARNING "max_entries must be between 1 and %u\n", AESD_MAX_DEPTH);
+        return -EINVAL;
+    }
+
+    if(ring_size > AESD_MAX_RING_SIZE){
+        printk(KERN_WARNING "ring_size can't be more than %u\n", AESD_MAX_RING_SIZE);
+        return -EINVAL;
+    }
+
+    if(devices == 0 || devices > AESD_MAX_DEVICES){
+        printk(KERN_WARNING "devices must be between 1 and %u\n", AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    result = aesd_line_caches_create();
+    if(result){
+        return result;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        aesd_line_caches_destroy();
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+
+    aesd_devices = kcalloc(devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if(aesd_devices == NULL){
+        unregister_chrdev_region(dev, devices);
+        aesd_line_caches_destroy();
+        return -ENOMEM;
+    }
+
+    // stats are best effort, debugfs failing doesn't stop the devices
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
 
     /**
      * TODO: initialize the AESD specific portion of the device
      */
-    mutex_init(&aesd_device.mtx);
+    for(i = 0; i < devices; i++){
+        result = aesd_dev_init(&aesd_devices[i]);
+        if(result){
+            break;
+        }
+
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if(result){
+            aesd_dev_cleanup(&aesd_devices[i]);
+            break;
+        }
 
-    result = aesd_setup_cdev(&aesd_device);
+        snprintf(name, sizeof(name), "%u", aesd_minor + i);
+        aesd_devices[i].debugfs = debugfs_create_dir(name, aesd_debugfs);
+        debugfs_create_file("stats", 0444, aesd_devices[i].debugfs, &aesd_devices[i],
+                &aesd_stats_fops);
+    }
 
+    // unwind the devices that made it before the failure
     if( result ) {
-        unregister_chrdev_region(dev, 1);
+        debugfs_remove_recursive(aesd_debugfs);
+        while(i-- > 0){
+            cdev_del(&aesd_devices[i].cdev);
+            aesd_dev_cleanup(&aesd_devices[i]);
+        }
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, devices);
+        aesd_line_caches_destroy();
     }
     return result;
 
@@ -334,28 +1786,25 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    struct aesd_buffer_entry *entry;
-    uint8_t i;
-
-    cdev_del(&aesd_device.cdev);
+    unsigned int i;
 
     /**
      * TODO: cleanup AESD specific poritions here as necessary
      */
+    // stats files go first, they look at the devices
+    debugfs_remove_recursive(aesd_debugfs);
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buf, i){
-        if(entry->size > 0){
-            kfree(entry->buffptr);
-        }
+    for(i = 0; i < devices; i++){
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_cleanup(&aesd_devices[i]);
     }
 
-    if(aesd_device.line_len > 0){
-        kfree(aesd_device.line_buf);
-    }
+    kfree(aesd_devices);
 
-    mutex_destroy(&aesd_device.mtx);
+    unregister_chrdev_region(devno, devices);
 
-    unregister_chrdev_region(devno, 1);
+    // every line has been freed by now, retired ones included
+    aesd_line_caches_destroy();
 }
 
 
@@ -1,7 +1,23 @@
 // Simple system call socket server
 // Usage:
-// ./aesdsocket [-d]
-//				daemon mode, forks and runs in background
+// ./aesdsocket [-d] [-e] [-z] [-t threads] [-q queue] [-s bytes] [-r segments]
+//				-d daemon mode, forks and runs in background
+//				-e event mode, multiplexes clients over epoll event loops
+//				   instead of serving each one from a worker thread
+//				-z zero copy mode, streams the data file back to clients
+//				   with sendfile/splice instead of read/send
+//				-t number of worker threads, defaults to POOL_DEFAULT_WORKERS.
+//				   A worker serves one client until it disconnects, so
+//				   this is how many clients can be connected at once
+//				   before new ones wait, use -e for more. In event mode
+//				   the number of event loops, defaults to the number of
+//				   online cores
+//				-q number of accepted clients that may wait for a free
+//				   worker before new ones are rejected
+//				-s size in bytes at which the data file log rotates to a
+//				   new segment (file backend only)
+//				-r number of log segments to retain, older history is
+//				   dropped (file backend only, defaults to keeping all)
 // Author: James Bohn
 // Adapted from Beej's guide (https://beej.us/guide/bgnet/html/)
 
@@ -17,72 +33,39 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <time.h>
-#include "queue.h"
 #include "vector.h"
-#include "../aesd-char-driver/aesd_ioctl.h"
-
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1
-#endif
+#include "datafile.h"
+#include "reactor.h"
+#include "pool.h"
 
 #define PORT "9000"  // the port users will be connecting to
-#define TIMESTAMP_SIZE 100
 #define TIMESTAMP_INTERVAL_S 10
 #define CHUNK_SIZE 200
 #define BACKLOG 10	 // how many pending connections queue will hold
 
-#if USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
-#else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
-
-
-// Struct to manage the data file across threads
-struct shared_file {
-	int fd;
-	pthread_mutex_t mtx;
-};
-
-struct thread_data {
-	pthread_t thread;
-	int client_fd;
-	bool complete;
-};
-
 // Struct holding fd's to close and pointers to memory/structs to free
 struct cleanup_data {
 	struct addrinfo *servinfo;
 	int sock_fd;
 	int new_fd;
 	int data_fd;
+	int sig_fd;
 };
 
 // Struct holding fd's to close and pointers to memory/structs to free
 struct thread_cleanup_data {
-	struct thread_data *t_data;
 	vector *recv_vec;
-	vector *send_vec;
-};
-
-// SLIST.
-typedef struct slist_data_s slist_data_t;
-struct slist_data_s {
-    struct thread_data td;
-    SLIST_ENTRY(slist_data_s) entries;
+	struct data_handle *data;
 };
 
 static bool sig_received = false;
-static struct shared_file data_file;
-
-void sig_handler(int s) {
-	sig_received = true;
-}
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa) {
@@ -99,70 +82,50 @@ void cleanup(struct cleanup_data *cd){
 	freeaddrinfo(cd->servinfo);
 	close(cd->sock_fd);
 	close(cd->new_fd);
+	if(cd->sig_fd != -1){
+		close(cd->sig_fd);
+	}
 
-	close(data_file.fd);
-	pthread_mutex_destroy(&data_file.mtx);
+	datafile_close();
 	closelog();
 }
 
-/// @brief Close/tree all open system resources for client threads
+/// @brief Close/free all open system resources for a client connection
 /// @param cd pointer to struct holding all the things to cleanup
 void thread_cleanup(struct thread_cleanup_data *cd){
 	vector_close(cd->recv_vec);
-	vector_close(cd->send_vec);
-	
-	cd->t_data->complete = true;
-}
 
-/// @brief function to be called every N seconds by posix timer that writes the 
-///        current timestamp to the data file
-/// @param sigval way to pass data into the function, unused
-#if !USE_AESD_CHAR_DEVICE
-void write_timestamp(union sigval sigval){
-	char time_string[TIMESTAMP_SIZE] = "timestamp:";
-	time_t now = time(0);
-	struct tm now_tm = *localtime(&now);
-	strftime(time_string + sizeof("timestamp:")-1, sizeof(time_string), "%a, %d %b %Y %T %z%n", &now_tm);
-
-
-	pthread_mutex_lock(&data_file.mtx);
-	if(write(data_file.fd, time_string, strlen(time_string)) == -1){
-		pthread_mutex_unlock(&data_file.mtx);
-		syslog(LOG_ERR, "error writing data to file");
-		return;				
-	}
-	pthread_mutex_unlock(&data_file.mtx);
+	datafile_put(cd->data);
 }
-#endif
-
-/// @brief Spawned thread to handle client connections
-/// @param thread_param structure containing input and output data for the client
-///		   connection
-/// @return NULL
-void *handle_connection(void *thread_param){
-	int received, written, rv;
-	vector recv_vec, send_vec;
+
+/// @brief Run by a pool worker to serve a client connection until it closes
+/// @param client_fd socket of the client, closed by the pool afterwards
+void handle_connection(int client_fd){
+	int received;
+	size_t written;
+	vector recv_vec;
 	char *new_line;
-	char read_char;
 	char recv_buf[CHUNK_SIZE];
 	struct thread_cleanup_data cd;
+	struct data_handle data;
 	bool seek_done;
 
-	// Cast paramater as correct struct
-	struct thread_data *t_data = (struct thread_data *) thread_param;
+	// open the data now that someone is using it (so that the driver)
+	// can be unloaded if no one is
+	if(datafile_get(&data)){
+		return;
+	}
 
 	// Set up data for easy cleanup
-	recv_vec.buf = NULL;
-	send_vec.buf = NULL;
-	cd.t_data = t_data;
+	recv_vec.base = NULL;
 	cd.recv_vec = &recv_vec;
-	cd.send_vec = &send_vec;
+	cd.data = &data;
 
 	// Clear receive buffer to prepare for receive
 	if(vector_init(&recv_vec)){
 		syslog(LOG_ERR, "vec_init fail\n");
 		thread_cleanup(&cd);
-		return NULL;
+		return;
 	}
 
 	// Loop until client closes connection
@@ -173,21 +136,22 @@ void *handle_connection(void *thread_param){
 		// Call receive until we've received a newline
 		while(!(new_line = vector_find(&recv_vec, recv_vec.len - received, '\n'))){
 
-			// Perform non-blocking receive
+			// Block until data arrives, main shuts down the read side of
+			// the socket on exit so this can't hang forever
 			do {
-				received = recv(t_data->client_fd, recv_buf, CHUNK_SIZE, 0);
-			} while (received == -1 && errno == EAGAIN);
+				received = recv(client_fd, recv_buf, CHUNK_SIZE, 0);
+			} while (received == -1 && errno == EINTR);
 
 			if(received < 0) {
 				syslog(LOG_ERR, "error on syscall: recv");
 				thread_cleanup(&cd);
-				return NULL;
+				return;
 			}
 			else if(received > 0){
 				if(vector_append(&recv_vec, recv_buf, received)){
 					syslog(LOG_ERR, "vec_append fail\n");
 					thread_cleanup(&cd);
-					return NULL;
+					return;
 				}
 			}
 			else {
@@ -203,42 +167,9 @@ void *handle_connection(void *thread_param){
 		}
 
 		// Write from the receive buffer into the data file one line at a time
-		written = 0;
-		while((new_line = vector_find(&recv_vec, written, '\n'))){
-
-			// check if received line is an ioctl command
-			#if USE_AESD_CHAR_DEVICE
-			struct aesd_seekto cmd;
-			char temp_char = *(new_line + 1);
-			*(new_line+1) = '\0';
-
-			// see if we can correctly pattern match the cmd string
-			if((rv = sscanf(recv_vec.buf+written, "AESDCHAR_IOCSEEKTO:%u,%u", &cmd.write_cmd, &cmd.write_cmd_offset) == 2)){
-				
-				// send off the ioctl
-				if(ioctl(data_file.fd, AESDCHAR_IOCSEEKTO, &cmd)){
-					syslog(LOG_ERR, "ioctl failure");
-				}
-
-				// skip this write to file and note that we shouldn't close and reopen later
-				seek_done = true;
-				*(new_line+1) = temp_char;
-				written += new_line + 1 - (char *)(recv_vec.buf+written);
-				continue;
-			}
-
-			*(new_line+1) = temp_char;
-			#endif
-
-			pthread_mutex_lock(&data_file.mtx);
-			if((rv = write(data_file.fd, recv_vec.buf+written, new_line + 1 - (char *)(recv_vec.buf+written))) == -1){
-				pthread_mutex_unlock(&data_file.mtx);
-				syslog(LOG_ERR, "error writing data to file");
-				thread_cleanup(&cd);
-				return NULL;				
-			}
-			pthread_mutex_unlock(&data_file.mtx);
-			written += rv;
+		if(datafile_write_lines(&data, &recv_vec, &written, &seek_done)){
+			thread_cleanup(&cd);
+			return;
 		}
 
 		// If we have have any extra data in the receive buffer, carry it through
@@ -247,80 +178,19 @@ void *handle_connection(void *thread_param){
 			vector_carryover(&recv_vec, written);
 		}
 		else{
-			vector_close(&recv_vec);
-			vector_init(&recv_vec);
-		}
-
-		if(vector_init(&send_vec)){
-			syslog(LOG_ERR, "vec_init fail\n");
-			thread_cleanup(&cd);
-			return NULL;
+			vector_reset(&recv_vec);
 		}
 
-		// Seek back to start of file for read
-		#if USE_AESD_CHAR_DEVICE
-		if(!seek_done){
-			close(data_file.fd);
-			data_file.fd = open(DATA_FILE, O_RDWR, 0644);
-		}
-		#else
-		pthread_mutex_lock(&data_file.mtx);
-		if(lseek(data_file.fd, 0, SEEK_SET) == -1){
-			pthread_mutex_unlock(&data_file.mtx);
-			syslog(LOG_ERR, "error seeking to start of file");
+		// Echo the whole file back, zero copy if enabled
+		if(datafile_send_all(&data, client_fd, seek_done)){
 			thread_cleanup(&cd);
-			return NULL;
+			return;
 		}
-		pthread_mutex_unlock(&data_file.mtx);
-		#endif
-
-		// Loop through chars in file
-		pthread_mutex_lock(&data_file.mtx);
-		while(1){
-			if((rv = read(data_file.fd, &read_char, 1)) != 1){
-				break;
-			}
-
-			// Apeend each char to the line buffer
-			if(vector_append(&send_vec, &read_char, 1)){
-				syslog(LOG_ERR, "vec_append fail\n");
-				pthread_mutex_unlock(&data_file.mtx);
-				thread_cleanup(&cd);
-				return NULL;
-			}
-
-			// If new line is found, send off and clear/re-init line buffer
-			if( read_char == '\n'){
-				// Perform non-blocking send
-				do {
-					rv = send(t_data->client_fd, send_vec.buf, send_vec.len, 0);
-				} while (rv == -1 && errno == EAGAIN);
-				if(rv == -1) {
-					syslog(LOG_ERR, "error on syscall: send");
-					pthread_mutex_unlock(&data_file.mtx);
-					thread_cleanup(&cd);
-					return NULL;
-				}
-
-				vector_close(&send_vec);
-				if(vector_init(&send_vec)){
-					syslog(LOG_ERR, "vec_init fail\n");
-					pthread_mutex_unlock(&data_file.mtx);
-					thread_cleanup(&cd);
-					return NULL;
-				}
-				continue;
-			}
-		}
-		pthread_mutex_unlock(&data_file.mtx);
-
-		// clear buffer to prepare for next receive
-		vector_close(&send_vec);
 	}
 
 	syslog(LOG_DEBUG, "thread exit\n");
 	thread_cleanup(&cd);
-	return NULL;
+	return;
 }
 
 int main(int argc, char **argv) {
@@ -328,13 +198,19 @@ int main(int argc, char **argv) {
 	int new_fd=0; // new connections on new_fd
 	struct addrinfo hints, *servinfo=NULL, *p;
 	struct sockaddr_storage their_addr; // connector's address information
-	struct sigaction sa;
+	sigset_t sig_mask;
+	struct signalfd_siginfo sig_info;
+	struct pollfd poll_fds[2];
 	socklen_t sin_size;
 	int yes=1;
 	char s[INET6_ADDRSTRLEN];
 	int rv;
 	int flags;
-	int active_conns = 0;
+	int opt;
+	int queue_size = POOL_QUEUE_SIZE;
+	bool daemon_mode = false;
+	bool event_mode = false;
+	int num_threads = 0;
 	pid_t pid;
 
 	// setup stuff to cleanup
@@ -342,30 +218,67 @@ int main(int argc, char **argv) {
 	cd.servinfo = servinfo;
 	cd.sock_fd = sock_fd;
 	cd.new_fd = new_fd;
+	cd.sig_fd = -1;
 
 	// setup shared data file
-	data_file.fd = 0;
-	pthread_mutex_init(&data_file.mtx, NULL);
+	datafile_init();
 
 	openlog("server_log", LOG_CONS | LOG_NDELAY, LOG_USER);
 
-	// setup SLIST
-	slist_data_t *datap=NULL;
-	slist_data_t *nextp=NULL;
-    SLIST_HEAD(slisthead, slist_data_s) head;
-    SLIST_INIT(&head);
-
-	// install handler for SIGINT and SIGTERM
-	sa.sa_handler = sig_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
-	if (sigaction(SIGINT, &sa, NULL) == -1) {
-		syslog(LOG_ERR, "error on syscall: sigaction");
+	while((opt = getopt(argc, argv, "dezt:q:s:r:")) != -1){
+		switch(opt){
+			case 'd':
+				daemon_mode = true;
+				break;
+			case 'e':
+				event_mode = true;
+				break;
+			case 'z':
+				data_file.zero_copy = true;
+				break;
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'q':
+				queue_size = atoi(optarg);
+				break;
+			case 's':
+				data_file.segment_size = atoll(optarg);
+				break;
+			case 'r':
+				data_file.max_segments = atoi(optarg);
+				break;
+			default:
+				syslog(LOG_ERR, "usage: %s [-d] [-e] [-z] [-t threads] [-q queue] [-s bytes] [-r segments]", argv[0]);
+				cleanup(&cd);
+				return -1;
+		}
+	}
+	if(num_threads < 1){
+		// loops multiplex clients so want a core each, workers are tied up by
+		// a client each for as long as it stays connected
+		num_threads = event_mode ? sysconf(_SC_NPROCESSORS_ONLN) : POOL_DEFAULT_WORKERS;
+	}
+	if(num_threads < 1){
+		num_threads = 1;
+	}
+	if(queue_size < 1){
+		queue_size = 1;
+	}
+
+	// Block SIGINT and SIGTERM (in every thread spawned from here on) and
+	// collect them through a signalfd so the accept loop can sleep in poll
+	sigemptyset(&sig_mask);
+	sigaddset(&sig_mask, SIGINT);
+	sigaddset(&sig_mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &sig_mask, NULL)) {
+		syslog(LOG_ERR, "error on syscall: pthread_sigmask");
 		cleanup(&cd);
 		return -1;
 	}
-	if (sigaction(SIGTERM, &sa, NULL) == -1) {
-		syslog(LOG_ERR, "error on syscall: sigaction");
+	cd.sig_fd = signalfd(-1, &sig_mask, SFD_CLOEXEC);
+	if (cd.sig_fd == -1) {
+		syslog(LOG_ERR, "error on syscall: signalfd");
 		cleanup(&cd);
 		return -1;
 	}
@@ -410,7 +323,7 @@ int main(int argc, char **argv) {
 	}
 
 	// Close fd and exit if in daemon mode
-	if(argc > 1 && !strcmp(argv[1], "-d")){
+	if(daemon_mode){
 		pid = fork();
 		if(pid == -1) {
 			syslog(LOG_ERR, "error on syscall: fork");
@@ -450,6 +363,8 @@ int main(int argc, char **argv) {
 	freeaddrinfo(servinfo); // all done with this structure
 	servinfo = NULL;
 
+	// Listening socket stays non-blocking so a client that disappears
+	// between poll and accept can't stall the loop
 	flags = fcntl(sock_fd, F_GETFL);
 	if(flags == -1) {
 		syslog(LOG_ERR, "error on syscall: fcntl");
@@ -470,13 +385,10 @@ int main(int argc, char **argv) {
 	}
 
 	// Create/wipe data file
-	data_file.fd = open(DATA_FILE, O_CREAT | O_RDWR | O_TRUNC,0644);
-	if(data_file.fd == -1) {
-		syslog(LOG_ERR, "error creating data file");
+	if(datafile_create()) {
 		cleanup(&cd);
 		return -1;
 	}
-	close(data_file.fd);
 
 	#if !USE_AESD_CHAR_DEVICE
 	struct sigevent sev;
@@ -488,7 +400,7 @@ int main(int argc, char **argv) {
 	memset(&sev, 0, sizeof(struct sigevent));
 	sev.sigev_notify = SIGEV_THREAD;
 	sev.sigev_value.sival_ptr = &data_file;
-	sev.sigev_notify_function = write_timestamp;
+	sev.sigev_notify_function = datafile_write_timestamp;
 	timer_create(CLOCK_REALTIME, &sev, &timer);
 	
 	sleep_time.tv_sec = TIMESTAMP_INTERVAL_S;
@@ -498,24 +410,59 @@ int main(int argc, char **argv) {
 	timer_settime(timer, 0, &spec, NULL);
 	#endif
 
+	// Start the event loops or worker threads that will own client connections
+	if(event_mode){
+		rv = reactor_start(num_threads);
+	}
+	else{
+		rv = pool_start(num_threads, queue_size, handle_connection);
+	}
+	if(rv){
+		cleanup(&cd);
+		return -1;
+	}
+
 	syslog(LOG_DEBUG, "waiting for connections...\n");
 
+	poll_fds[0].fd = sock_fd;
+	poll_fds[0].events = POLLIN;
+	poll_fds[1].fd = cd.sig_fd;
+	poll_fds[1].events = POLLIN;
+
 	while(!sig_received) {  // main accept() loop
 		sin_size = sizeof(their_addr);
 
-		// Handle non-blocking accept
-		do {
-			new_fd = accept(sock_fd, (struct sockaddr *)&their_addr, &sin_size);
-		} while (new_fd == -1 && errno == EAGAIN && !sig_received);
-		if(new_fd == -1) {
-			if(sig_received) {
-				break;
+		// Sleep until a client is waiting or a signal arrives
+		if(poll(poll_fds, 2, -1) == -1) {
+			if(errno == EINTR) {
+				continue;
 			}
-			else {
-				syslog(LOG_ERR, "error on syscall: accept");
-				cleanup(&cd);
-				return -1;				
+			syslog(LOG_ERR, "error on syscall: poll");
+			cleanup(&cd);
+			return -1;
+		}
+
+		if(poll_fds[1].revents & POLLIN) {
+			if(read(cd.sig_fd, &sig_info, sizeof(sig_info)) == -1) {
+				syslog(LOG_ERR, "error on syscall: read");
 			}
+			sig_received = true;
+			break;
+		}
+
+		if(!(poll_fds[0].revents & POLLIN)) {
+			continue;
+		}
+
+		new_fd = accept(sock_fd, (struct sockaddr *)&their_addr, &sin_size);
+		if(new_fd == -1) {
+			// client went away before we got to it, go back to waiting
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: accept");
+			cleanup(&cd);
+			return -1;
 		}
 
 		// Find client IP
@@ -524,62 +471,37 @@ int main(int argc, char **argv) {
 			s, sizeof(s));
 		syslog(LOG_DEBUG, "Accepted connection from %s\n", s);
 
-		// Allocate space for and add thread_data to LL
-		datap = malloc(sizeof(slist_data_t));
-		datap->td.client_fd = new_fd;
-		datap->td.complete = false;
-		SLIST_INSERT_HEAD(&head, datap, entries);
-
-		// open the data now that someone is using it (so that the driver)
-		// can be unloaded if no one is
-		if(active_conns == 0){
-			data_file.fd = open(DATA_FILE, O_RDWR, 0644);
-		} 
-
-		// Spawn the thread for the client connection
-		pthread_create(&datap->td.thread, NULL, handle_connection, &datap->td);
-		active_conns += 1;
-
-		// Check if any threads are complete and reap/clean them up
-		SLIST_FOREACH_SAFE(datap, &head, entries, nextp){
-			if(datap->td.complete){
-				pthread_join(datap->td.thread, NULL);
-				syslog(LOG_DEBUG, "Closed connection from %s\n", s);
-				close(datap->td.client_fd);
-				SLIST_REMOVE(&head, datap, slist_data_s, entries);
-				free(datap);
-				active_conns -= 1;
-			}
+		// In event mode the loops take over the client from here
+		if(event_mode){
+			reactor_add(new_fd);
+			continue;
 		}
 
-		// close the data now that no one is using it
-		if(active_conns == 0){
-			close(data_file.fd);
-		} 
+		// Otherwise queue it for a worker, turning it away if too many
+		// clients are already waiting
+		if(pool_submit(new_fd)){
+			syslog(LOG_WARNING, "Connection queue full, rejecting %s\n", s);
+			close(new_fd);
+		}
 	}
 
 	if(sig_received){
 		syslog(LOG_DEBUG, "Caught signal, exiting\n");
 	}
 
-	// Reap remaining connections after they've finished their current packet
-	while(active_conns > 0){
-		SLIST_FOREACH_SAFE(datap, &head, entries, nextp){
-		if(datap->td.complete){
-				pthread_join(datap->td.thread, NULL);
-				syslog(LOG_DEBUG, "Closed connection from %s\n", s);
-				close(datap->td.client_fd);
-				SLIST_REMOVE(&head, datap, slist_data_s, entries);
-				free(datap);
-				active_conns -= 1;
-			}
-		}
+	// Event loops close whatever connections they still hold, workers finish
+	// their current packet
+	if(event_mode){
+		reactor_stop();
+	}
+	else{
+		pool_stop();
 	}
 
 	// Delete the data file
 	#if !USE_AESD_CHAR_DEVICE
-	if (unlink(DATA_FILE) == -1) {
-		syslog(LOG_ERR, "error on syscall: unlink");
+	if (datafile_remove() == -1) {
+		syslog(LOG_ERR, "error removing data file");
 		cleanup(&cd);
 		return -1;
 	}
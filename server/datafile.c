@@ -0,0 +1,505 @@
+// Data file shared by every client connection of the socket server
+// The char device is opened separately by every connection so each has its own
+// position, the file backend is an append-only segmented log (see logstore.c)
+// read through private cursors
+// Author: James Bohn
+
+#define _GNU_SOURCE
+#include "datafile.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+struct shared_file data_file;
+
+/// @brief Set up the shared data file state and the lock protecting it
+void datafile_init(void){
+	data_file.zero_copy = false;
+	data_file.no_splice = false;
+	data_file.segment_size = LOGSTORE_SEGMENT_SIZE;
+	data_file.max_segments = LOGSTORE_MAX_SEGMENTS;
+	pthread_rwlock_init(&data_file.lock, NULL);
+}
+
+/// @brief Create/wipe the data file
+/// @return 0 on success, -1 on failure
+int datafile_create(void){
+	int rv = 0;
+
+	pthread_rwlock_wrlock(&data_file.lock);
+	#if USE_AESD_CHAR_DEVICE
+	int fd;
+
+	fd = open(DATA_FILE, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if(fd == -1) {
+		syslog(LOG_ERR, "error creating data file");
+		rv = -1;
+	}
+	else {
+		close(fd);
+	}
+	#else
+	rv = logstore_open(DATA_FILE, data_file.segment_size, data_file.max_segments);
+	#endif
+	pthread_rwlock_unlock(&data_file.lock);
+
+	return rv;
+}
+
+/// @brief Delete the data file, the char device is left alone
+/// @return 0 on success, -1 on failure
+int datafile_remove(void){
+	#if !USE_AESD_CHAR_DEVICE
+	pthread_rwlock_wrlock(&data_file.lock);
+	logstore_remove();
+	pthread_rwlock_unlock(&data_file.lock);
+	#endif
+	return 0;
+}
+
+/// @brief Set up a connection's view of the data file. With the char device
+///        this opens a private fd, so the driver can be unloaded while no one
+///        is connected and seeks only move this connection's position.
+/// @param handle pointer to handle to initialize
+/// @return 0 on success, -1 on failure
+int datafile_get(struct data_handle *handle){
+	handle->fd = -1;
+
+	#if USE_AESD_CHAR_DEVICE
+	handle->fd = open(DATA_FILE, O_RDWR | O_CLOEXEC);
+	if(handle->fd == -1){
+		syslog(LOG_ERR, "error opening data file");
+		return -1;
+	}
+	#endif
+
+	return 0;
+}
+
+/// @brief Release a connection's view of the data file
+/// @param handle pointer to handle set up by datafile_get
+void datafile_put(struct data_handle *handle){
+	if(handle->fd != -1){
+		close(handle->fd);
+		handle->fd = -1;
+	}
+}
+
+/// @brief Append a batch of data to whichever backend holds the data file.
+///        Caller must hold data_file.lock.
+/// @param handle pointer to the writing connection's handle
+/// @param iov data to write
+/// @param iov_cnt # of entries in iov
+/// @return # of bytes written (may be short), -1 on failure
+static ssize_t data_writev(struct data_handle *handle, const struct iovec *iov, int iov_cnt){
+	#if USE_AESD_CHAR_DEVICE
+	return writev(handle->fd, iov, iov_cnt);
+	#else
+	return logstore_append(iov, iov_cnt);
+	#endif
+}
+
+#if USE_AESD_CHAR_DEVICE
+/// @brief Parse a line as a seek command. The line isn't terminated and can end
+///        right at the end of the vector's allocation, so a terminated copy is
+///        parsed instead.
+/// @param line pointer to the start of the line
+/// @param len # of bytes in the line, including its newline
+/// @param cmd set to the parsed command
+/// @return true if the line is a seek command
+static bool parse_seek_cmd(const char *line, size_t len, struct aesd_seekto *cmd){
+	char cmd_str[SEEK_CMD_MAX];
+
+	// cheap checks first, most lines are plain data
+	if(len >= SEEK_CMD_MAX || len <= strlen(SEEK_CMD_PREFIX) ||
+			memcmp(line, SEEK_CMD_PREFIX, strlen(SEEK_CMD_PREFIX)) != 0){
+		return false;
+	}
+
+	memcpy(cmd_str, line, len);
+	cmd_str[len] = '\0';
+	return sscanf(cmd_str, SEEK_CMD_PREFIX "%u,%u", &cmd->write_cmd, &cmd->write_cmd_offset) == 2;
+}
+#endif
+
+/// @brief Commit gathered lines to the data file with as few writev calls as
+///        possible. Caller must hold data_file.lock.
+/// @param handle pointer to the writing connection's handle
+/// @param iov array of line runs to write, modified to track partial writes
+/// @param iov_cnt # of entries in iov, reset to 0 once everything is written
+/// @return 0 on success, -1 on failure
+static int flush_lines(struct data_handle *handle, struct iovec *iov, int *iov_cnt){
+	struct iovec *cur = iov;
+	int cnt = *iov_cnt;
+	ssize_t rv;
+
+	while(cnt > 0){
+		rv = data_writev(handle, cur, cnt);
+		if(rv == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error writing data to file");
+			return -1;
+		}
+
+		// skip whatever made it out and trim a partially written run
+		while(cnt > 0 && (size_t)rv >= cur->iov_len){
+			rv -= cur->iov_len;
+			cur++;
+			cnt--;
+		}
+		if(cnt > 0){
+			cur->iov_base += rv;
+			cur->iov_len -= rv;
+		}
+	}
+
+	*iov_cnt = 0;
+	return 0;
+}
+
+/// @brief Write every complete line in the vector to the data file, treating
+///        AESDCHAR_IOCSEEKTO lines as commands when backed by the char device.
+///        Lines are gathered and committed with a single writev, only flushing
+///        early ahead of a seek command. Whole lines are always appended in
+///        one call, so concurrent writers only ever interleave between lines.
+/// @param handle pointer to the writing connection's handle
+/// @param vec pointer to vector holding received data
+/// @param used set to the # of bytes consumed from the front of the vector
+/// @param seek_done set to true if a seek command was issued
+/// @return 0 on success, -1 on failure
+int datafile_write_lines(struct data_handle *handle, vector *vec, size_t *used, bool *seek_done){
+	struct iovec iov[WRITE_IOV_MAX];
+	struct iovec *last;
+	int iov_cnt = 0;
+	size_t written = 0;
+	size_t line_ends[LINE_BATCH_SIZE];
+	size_t line_cnt, i;
+	size_t line_len;
+	char *new_line;
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&data_file.lock);
+	// Find newlines a batch at a time, the scan is vectorized (see vector.c)
+	while(ret == 0 && (line_cnt = vector_find_all(vec, written, '\n', line_ends, LINE_BATCH_SIZE)) > 0){
+		for(i = 0; i < line_cnt && ret == 0; i++){
+			new_line = vec->buf + line_ends[i];
+			line_len = new_line + 1 - (char *)(vec->buf+written);
+
+			// check if received line is an ioctl command
+			#if USE_AESD_CHAR_DEVICE
+			struct aesd_seekto cmd;
+
+			// see if we can correctly pattern match the cmd string
+			if(parse_seek_cmd(vec->buf+written, line_len, &cmd)){
+				// lines ahead of the command have to land before the seek
+				if(flush_lines(handle, iov, &iov_cnt)){
+					ret = -1;
+					break;
+				}
+
+				// send off the ioctl, only this connection's position moves
+				if(ioctl(handle->fd, AESDCHAR_IOCSEEKTO, &cmd)){
+					syslog(LOG_ERR, "ioctl failure");
+				}
+
+				// skip this write to file and note that we shouldn't rewind later
+				*seek_done = true;
+				written += line_len;
+				continue;
+			}
+			#endif
+
+			// extend the current run if this line directly follows it
+			last = iov_cnt ? &iov[iov_cnt - 1] : NULL;
+			if(last && last->iov_base + last->iov_len == vec->buf + written){
+				last->iov_len += line_len;
+			}
+			else{
+				if(iov_cnt == WRITE_IOV_MAX && flush_lines(handle, iov, &iov_cnt)){
+					ret = -1;
+					break;
+				}
+				iov[iov_cnt].iov_base = vec->buf + written;
+				iov[iov_cnt].iov_len = line_len;
+				iov_cnt++;
+			}
+			written += line_len;
+		}
+	}
+
+	if(ret == 0 && flush_lines(handle, iov, &iov_cnt)){
+		ret = -1;
+	}
+	pthread_rwlock_unlock(&data_file.lock);
+
+	*used = written;
+	return ret;
+}
+
+/// @brief Read the full contents of the data file into a vector
+/// @param handle pointer to the reading connection's handle
+/// @param out pointer to initialized vector to append the contents to
+/// @param seek_done true if a seek command set the position to read from
+/// @return 0 on success, -1 on failure
+int datafile_read_all(struct data_handle *handle, vector *out, bool seek_done){
+	char read_buf[READ_CHUNK_SIZE];
+	ssize_t rv;
+
+	pthread_rwlock_rdlock(&data_file.lock);
+
+	#if USE_AESD_CHAR_DEVICE
+	// Seek back to start of device for read
+	if(!seek_done && lseek(handle->fd, 0, SEEK_SET) == -1){
+		pthread_rwlock_unlock(&data_file.lock);
+		syslog(LOG_ERR, "error seeking to start of file");
+		return -1;
+	}
+
+	while((rv = read(handle->fd, read_buf, READ_CHUNK_SIZE)) > 0){
+	#else
+	struct log_cursor cur;
+
+	// Private cursor over the log, appends carry on while we read
+	logstore_cursor_init(&cur);
+	while((rv = logstore_read(&cur, read_buf, READ_CHUNK_SIZE)) > 0){
+	#endif
+		if(vector_append(out, read_buf, rv)){
+			pthread_rwlock_unlock(&data_file.lock);
+			syslog(LOG_ERR, "vec_append fail\n");
+			return -1;
+		}
+	}
+	pthread_rwlock_unlock(&data_file.lock);
+
+	if(rv == -1){
+		syslog(LOG_ERR, "error reading data file");
+		return -1;
+	}
+
+	return 0;
+}
+
+/// @brief Send a whole buffer over a blocking socket
+/// @param sock_fd socket to send on
+/// @param vec pointer to vector holding the data to send
+/// @return 0 on success, -1 on failure
+static int send_buffer(int sock_fd, vector *vec){
+	size_t sent;
+	ssize_t rv;
+
+	for(sent = 0; sent < vec->len; sent += rv){
+		rv = send(sock_fd, vec->buf + sent, vec->len - sent, MSG_NOSIGNAL);
+		if(rv == -1){
+			if(errno == EINTR){
+				rv = 0;
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: send");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#if USE_AESD_CHAR_DEVICE
+/// @brief Stream the device to a socket through a pipe with splice so the data
+///        never passes through user space. Caller must hold data_file.lock.
+/// @param handle pointer to the reading connection's handle
+/// @param sock_fd blocking socket to send on
+/// @param seek_done true if a seek command set the position to read from
+/// @return 0 on success, -1 on failure, 1 if the driver can't be spliced from
+///         (nothing has been read in that case)
+static int send_zero_copy(struct data_handle *handle, int sock_fd, bool seek_done){
+	int pipe_fds[2];
+	ssize_t in_pipe, moved;
+	bool first = true;
+	int ret = 0;
+
+	if(!seek_done && lseek(handle->fd, 0, SEEK_SET) == -1){
+		syslog(LOG_ERR, "error seeking to start of file");
+		return -1;
+	}
+
+	if(pipe2(pipe_fds, O_CLOEXEC) == -1){
+		syslog(LOG_ERR, "error on syscall: pipe2");
+		return -1;
+	}
+
+	while(1){
+		in_pipe = splice(handle->fd, NULL, pipe_fds[1], NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE);
+		if(in_pipe == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(first && errno == EINVAL){
+				ret = 1;
+				break;
+			}
+			syslog(LOG_ERR, "error on syscall: splice");
+			ret = -1;
+			break;
+		}
+		if(in_pipe == 0){
+			break;
+		}
+		first = false;
+
+		// drain the pipe into the socket before pulling more
+		while(in_pipe > 0){
+			moved = splice(pipe_fds[0], NULL, sock_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(moved == -1){
+				if(errno == EINTR){
+					continue;
+				}
+				syslog(LOG_ERR, "error on syscall: splice");
+				ret = -1;
+				break;
+			}
+			in_pipe -= moved;
+		}
+		if(ret){
+			break;
+		}
+	}
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	return ret;
+}
+#else
+/// @brief Stream the log to a socket with sendfile so the data never passes
+///        through user space. Uses a private cursor, so appends that land
+///        mid-stream are left for the next echo. Caller must hold
+///        data_file.lock.
+/// @param handle unused for the file backend
+/// @param sock_fd blocking socket to send on
+/// @param seek_done unused for the file backend
+/// @return 0 on success, -1 on failure
+static int send_zero_copy(struct data_handle *handle, int sock_fd, bool seek_done){
+	struct log_cursor cur;
+	ssize_t rv;
+
+	logstore_cursor_init(&cur);
+	while(cur.pos < cur.end){
+		rv = logstore_sendfile(&cur, sock_fd, cur.end - cur.pos);
+		if(rv == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: sendfile");
+			return -1;
+		}
+		if(rv == 0){
+			break;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/// @brief Echo the full contents of the data file to a blocking socket,
+///        streaming it zero copy when enabled and supported by the backend
+/// @param handle pointer to the reading connection's handle
+/// @param sock_fd socket to send on
+/// @param seek_done true if a seek command set the position to read from
+/// @return 0 on success, -1 on failure
+int datafile_send_all(struct data_handle *handle, int sock_fd, bool seek_done){
+	vector send_vec;
+	int rv;
+
+	// an older driver without splice support fails the same way every time,
+	// so only find that out once rather than on every echo
+	if(data_file.zero_copy && !__atomic_load_n(&data_file.no_splice, __ATOMIC_RELAXED)){
+		pthread_rwlock_rdlock(&data_file.lock);
+		rv = send_zero_copy(handle, sock_fd, seek_done);
+		pthread_rwlock_unlock(&data_file.lock);
+		if(rv <= 0){
+			return rv;
+		}
+		if(!__atomic_exchange_n(&data_file.no_splice, true, __ATOMIC_RELAXED)){
+			syslog(LOG_INFO, "device can't be spliced from, echoing through read/send");
+		}
+	}
+
+	if(vector_init(&send_vec)){
+		syslog(LOG_ERR, "vec_init fail\n");
+		return -1;
+	}
+
+	rv = datafile_read_all(handle, &send_vec, seek_done);
+	if(rv == 0){
+		rv = send_buffer(sock_fd, &send_vec);
+	}
+
+	vector_close(&send_vec);
+	return rv;
+}
+
+#if !USE_AESD_CHAR_DEVICE
+/// @brief Point a cursor at everything currently in the data file
+/// @param cur pointer to cursor to initialize
+void datafile_cursor_init(struct log_cursor *cur){
+	pthread_rwlock_rdlock(&data_file.lock);
+	logstore_cursor_init(cur);
+	pthread_rwlock_unlock(&data_file.lock);
+}
+
+/// @brief Send from the data file at a cursor straight to a socket
+/// @param sock_fd socket to send on, may be non-blocking
+/// @param cur pointer to cursor to send from, advanced past the bytes sent
+/// @return # of bytes sent, 0 once the cursor reached its end, -1 on failure
+///         with errno set
+ssize_t datafile_sendfile(int sock_fd, struct log_cursor *cur){
+	ssize_t rv;
+
+	pthread_rwlock_rdlock(&data_file.lock);
+	rv = logstore_sendfile(cur, sock_fd, cur->end - cur->pos);
+	pthread_rwlock_unlock(&data_file.lock);
+
+	return rv;
+}
+
+/// @brief function to be called every N seconds by posix timer that writes the
+///        current timestamp to the data file
+/// @param sigval way to pass data into the function, unused
+void datafile_write_timestamp(union sigval sigval){
+	char time_string[TIMESTAMP_SIZE] = "timestamp:";
+	struct iovec iov;
+	time_t now = time(0);
+	struct tm now_tm = *localtime(&now);
+	strftime(time_string + sizeof("timestamp:")-1, sizeof(time_string), "%a, %d %b %Y %T %z%n", &now_tm);
+
+	iov.iov_base = time_string;
+	iov.iov_len = strlen(time_string);
+
+	pthread_rwlock_rdlock(&data_file.lock);
+	if(data_writev(NULL, &iov, 1) == -1){
+		pthread_rwlock_unlock(&data_file.lock);
+		syslog(LOG_ERR, "error writing data to file");
+		return;
+	}
+	pthread_rwlock_unlock(&data_file.lock);
+}
+#endif
+
+/// @brief Close the data file and release the lock
+void datafile_close(void){
+	#if !USE_AESD_CHAR_DEVICE
+	pthread_rwlock_wrlock(&data_file.lock);
+	logstore_close();
+	pthread_rwlock_unlock(&data_file.lock);
+	#endif
+	pthread_rwlock_destroy(&data_file.lock);
+}
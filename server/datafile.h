@@ -0,0 +1,65 @@
+// Data file shared by every client connection of the socket server
+// Author: James Bohn
+
+#ifndef DATAFILE_H
+#define DATAFILE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include "vector.h"
+#include "logstore.h"
+
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#if USE_AESD_CHAR_DEVICE
+#define DATA_FILE "/dev/aesdchar"
+#else
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif
+
+#define TIMESTAMP_SIZE 100
+#define READ_CHUNK_SIZE 4096
+#define SPLICE_CHUNK_SIZE 65536
+#define WRITE_IOV_MAX 64
+#define LINE_BATCH_SIZE 64
+#define SEEK_CMD_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define SEEK_CMD_MAX 64	// longer lines are never taken as a seek command
+
+// Struct to manage the data file across threads
+struct shared_file {
+	bool zero_copy;	// stream echoes with sendfile/splice instead of read/send
+	bool no_splice;	// set once the device turned out not to support splice
+	off_t segment_size;	// log segment rotation size for the file backend
+	int max_segments;	// log segments retained by the file backend, 0 for all
+	// Taken shared by every read and append (which don't block each other),
+	// and exclusive only to create, remove or close the data file
+	pthread_rwlock_t lock;
+};
+
+// Per connection view of the data file
+struct data_handle {
+	int fd;	// private device fd with its own position, -1 for the file backend
+};
+
+extern struct shared_file data_file;
+
+void datafile_init(void);
+int datafile_create(void);
+int datafile_remove(void);
+int datafile_get(struct data_handle *handle);
+void datafile_put(struct data_handle *handle);
+int datafile_write_lines(struct data_handle *handle, vector *vec, size_t *used, bool *seek_done);
+int datafile_read_all(struct data_handle *handle, vector *out, bool seek_done);
+int datafile_send_all(struct data_handle *handle, int sock_fd, bool seek_done);
+#if !USE_AESD_CHAR_DEVICE
+void datafile_cursor_init(struct log_cursor *cur);
+ssize_t datafile_sendfile(int sock_fd, struct log_cursor *cur);
+void datafile_write_timestamp(union sigval sigval);
+#endif
+void datafile_close(void);
+
+#endif
@@ -0,0 +1,425 @@
+// Append-only log of line data split across fixed size segment files
+// The first segment is the log's own path so logs that never rotate look like
+// a plain data file, later ones are path.1, path.2 ... Appends go to the
+// newest segment, which is rotated once it passes the segment size, and the
+// oldest segments are dropped past the retention limit. Readers own their
+// cursor and use pread/sendfile, so they never share a file position with
+// each other or with appenders. Only a few segments are kept open at once so
+// unlimited retention can't run the process out of fds, older ones are
+// reopened when a reader gets to them.
+// Author: James Bohn
+
+#include "logstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/sendfile.h>
+
+struct log_segment {
+	int fd;			// -1 while closed (see segment_trim)
+	uint64_t seq;		// suffix of the segment's file name
+	off_t base;		// log offset of the segment's first byte
+	off_t size;		// bytes written, read atomically by readers
+	int refs;		// readers currently using fd
+	bool dropped;		// past retention, freed once refs reaches 0
+	uint64_t last_use;	// store.uses when last taken by a reader
+};
+
+// room left in a path for the segment suffix
+#define SEGMENT_SUFFIX_MAX 24
+
+static struct {
+	char path[PATH_MAX - SEGMENT_SUFFIX_MAX];
+	off_t segment_size;
+	int max_segments;
+	struct log_segment **segs;	// oldest first, last one is being appended to
+	int num_segs;
+	int segs_cap;
+	int open_fds;			// segments with their fd open
+	uint64_t uses;			// segment_get calls, orders segments by last use
+	pthread_mutex_t append_mtx;	// serializes appends and rotation
+	pthread_mutex_t list_mtx;	// protects segs and refs, only held briefly
+} store;
+
+/// @brief Build the file name of a segment, the first one has no suffix
+/// @param seq sequence number of the segment
+/// @param buf buffer of PATH_MAX bytes to write the name to
+static void segment_path(uint64_t seq, char *buf){
+	if(seq == 0){
+		snprintf(buf, PATH_MAX, "%s", store.path);
+	}
+	else{
+		snprintf(buf, PATH_MAX, "%s.%llu", store.path, (unsigned long long)seq);
+	}
+}
+
+/// @brief Release a segment's file and memory. Caller must hold list_mtx.
+/// @param seg pointer to segment to free
+static void segment_free(struct log_segment *seg){
+	if(seg->fd != -1){
+		close(seg->fd);
+		store.open_fds -= 1;
+	}
+	free(seg);
+}
+
+/// @brief Close the fds of the least recently used segments no reader is
+///        using while too many are open. The segment being appended to is
+///        always kept open. Only called when an fd has just been opened, so
+///        the scan doesn't run on every read. Caller must hold list_mtx.
+static void segment_trim(void){
+	struct log_segment *seg, *lru;
+	int i;
+
+	while(store.open_fds > LOGSTORE_MAX_OPEN){
+		lru = NULL;
+		for(i = 0; i < store.num_segs - 1; i++){
+			seg = store.segs[i];
+			if(seg->fd != -1 && seg->refs == 0 &&
+					(lru == NULL || seg->last_use < lru->last_use)){
+				lru = seg;
+			}
+		}
+		if(lru == NULL){
+			break;
+		}
+
+		close(lru->fd);
+		lru->fd = -1;
+		store.open_fds -= 1;
+	}
+}
+
+/// @brief Create a new empty segment file and make it the one appended to.
+///        Caller must hold append_mtx.
+/// @param seq sequence number for the new segment
+/// @param base log offset of the new segment's first byte
+/// @return 0 on success, -1 on failure
+static int segment_add(uint64_t seq, off_t base){
+	char path[PATH_MAX];
+	struct log_segment *seg;
+	struct log_segment **segs;
+
+	seg = calloc(1, sizeof(struct log_segment));
+	if(seg == NULL){
+		syslog(LOG_ERR, "failed to allocate log segment");
+		return -1;
+	}
+
+	segment_path(seq, path);
+	seg->fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if(seg->fd == -1){
+		syslog(LOG_ERR, "error creating log segment %s", path);
+		free(seg);
+		return -1;
+	}
+	seg->seq = seq;
+	seg->base = base;
+
+	pthread_mutex_lock(&store.list_mtx);
+	store.open_fds += 1;
+	if(store.num_segs == store.segs_cap){
+		segs = realloc(store.segs, 2 * (store.segs_cap + 1) * sizeof(*segs));
+		if(segs == NULL){
+			// segment_free takes back the fd counted above
+			unlink(path);
+			segment_free(seg);
+			pthread_mutex_unlock(&store.list_mtx);
+			syslog(LOG_ERR, "failed to grow log segment list");
+			return -1;
+		}
+		store.segs = segs;
+		store.segs_cap = 2 * (store.segs_cap + 1);
+	}
+	store.segs[store.num_segs++] = seg;
+
+	// the segment rotated out may be one fd too many
+	segment_trim();
+
+	// enforce retention by retiring the oldest segments
+	while(store.max_segments > 0 && store.num_segs > store.max_segments){
+		seg = store.segs[0];
+		memmove(store.segs, store.segs + 1, (store.num_segs - 1) * sizeof(*segs));
+		store.num_segs -= 1;
+
+		segment_path(seg->seq, path);
+		unlink(path);
+		seg->dropped = true;
+		if(seg->refs == 0){
+			segment_free(seg);
+		}
+	}
+	pthread_mutex_unlock(&store.list_mtx);
+
+	return 0;
+}
+
+/// @brief Drop a reference taken with segment_get
+/// @param seg pointer to segment to release
+static void segment_put(struct log_segment *seg){
+	pthread_mutex_lock(&store.list_mtx);
+	seg->refs -= 1;
+	if(seg->dropped && seg->refs == 0){
+		segment_free(seg);
+	}
+	pthread_mutex_unlock(&store.list_mtx);
+}
+
+/// @brief Take a reference to the segment holding a cursor's position,
+///        moving the cursor up to the oldest data if it fell behind retention
+///        and reopening the segment if it was closed
+/// @param cur pointer to cursor to look up
+/// @return pointer to segment, NULL with errno set on failure
+static struct log_segment *segment_get(struct log_cursor *cur){
+	char path[PATH_MAX];
+	struct log_segment *seg;
+	int lo, hi, mid;
+	int fd, err;
+
+	pthread_mutex_lock(&store.list_mtx);
+	if(store.num_segs == 0){
+		pthread_mutex_unlock(&store.list_mtx);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if(cur->pos < store.segs[0]->base){
+		cur->pos = store.segs[0]->base;
+	}
+
+	// find the last segment starting at or before the cursor
+	lo = 0;
+	hi = store.num_segs - 1;
+	while(lo < hi){
+		mid = (lo + hi + 1) / 2;
+		if(store.segs[mid]->base <= cur->pos){
+			lo = mid;
+		}
+		else{
+			hi = mid - 1;
+		}
+	}
+
+	seg = store.segs[lo];
+	seg->refs += 1;
+	seg->last_use = ++store.uses;
+	if(seg->fd != -1){
+		pthread_mutex_unlock(&store.list_mtx);
+		return seg;
+	}
+	segment_path(seg->seq, path);
+	pthread_mutex_unlock(&store.list_mtx);
+
+	// reopen without holding up other readers, the reference keeps the
+	// segment from being freed or trimmed meanwhile
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1){
+		err = errno;
+		syslog(LOG_ERR, "error reopening log segment %s", path);
+		segment_put(seg);
+		errno = err;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&store.list_mtx);
+	if(seg->fd == -1){
+		seg->fd = fd;
+		fd = -1;
+		store.open_fds += 1;
+		segment_trim();
+	}
+	pthread_mutex_unlock(&store.list_mtx);
+
+	// another reader got it open first
+	if(fd != -1){
+		close(fd);
+	}
+
+	return seg;
+}
+
+/// @brief Find how many bytes a cursor can take from its segment right now
+/// @param cur pointer to cursor positioned inside seg
+/// @param seg pointer to segment holding the cursor's position
+/// @param len max # of bytes wanted
+/// @return # of bytes available
+static size_t segment_avail(struct log_cursor *cur, struct log_segment *seg, size_t len){
+	off_t seg_end = seg->base + __atomic_load_n(&seg->size, __ATOMIC_ACQUIRE);
+	off_t avail = (seg_end < cur->end ? seg_end : cur->end) - cur->pos;
+
+	if(avail <= 0){
+		return 0;
+	}
+	return (size_t)avail < len ? (size_t)avail : len;
+}
+
+/// @brief Wipe any segments left behind by an earlier run and start a new log
+/// @param path file name of the first segment, later ones are stored as path.N
+/// @param segment_size # of bytes after which a segment is rotated
+/// @param max_segments # of segments to retain, 0 for no limit
+/// @return 0 on success, -1 on failure
+int logstore_open(const char *path, off_t segment_size, int max_segments){
+	char pattern[PATH_MAX];
+	glob_t stale;
+	size_t i;
+
+	memset(&store, 0, sizeof(store));
+	snprintf(store.path, sizeof(store.path), "%s", path);
+	store.segment_size = segment_size > 0 ? segment_size : LOGSTORE_SEGMENT_SIZE;
+	store.max_segments = max_segments;
+	pthread_mutex_init(&store.append_mtx, NULL);
+	pthread_mutex_init(&store.list_mtx, NULL);
+
+	snprintf(pattern, PATH_MAX, "%s.*", path);
+	if(glob(pattern, GLOB_NOSORT, NULL, &stale) == 0){
+		for(i = 0; i < stale.gl_pathc; i++){
+			unlink(stale.gl_pathv[i]);
+		}
+	}
+	globfree(&stale);
+
+	// segment 0 is created with O_TRUNC, wiping the old one
+	return segment_add(0, 0);
+}
+
+/// @brief Append data to the log, rotating the segment if it grew past the
+///        segment size. Only whole lines should be appended so that segments
+///        always break on a line boundary.
+/// @param iov data to append
+/// @param iov_cnt # of entries in iov
+/// @return # of bytes appended (may be short, like writev), -1 on failure
+ssize_t logstore_append(const struct iovec *iov, int iov_cnt){
+	struct log_segment *seg;
+	ssize_t rv;
+
+	pthread_mutex_lock(&store.append_mtx);
+	seg = store.segs[store.num_segs - 1];
+
+	rv = writev(seg->fd, iov, iov_cnt);
+	if(rv > 0){
+		__atomic_store_n(&seg->size, seg->size + rv, __ATOMIC_RELEASE);
+
+		if(seg->size >= store.segment_size &&
+				segment_add(seg->seq + 1, seg->base + seg->size)){
+			syslog(LOG_ERR, "failed to rotate log, continuing in current segment");
+		}
+	}
+
+	pthread_mutex_unlock(&store.append_mtx);
+	return rv;
+}
+
+/// @brief Point a cursor at everything currently retained in the log
+/// @param cur pointer to cursor to initialize
+void logstore_cursor_init(struct log_cursor *cur){
+	struct log_segment *last;
+
+	pthread_mutex_lock(&store.list_mtx);
+	last = store.segs[store.num_segs - 1];
+	cur->pos = store.segs[0]->base;
+	cur->end = last->base + __atomic_load_n(&last->size, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&store.list_mtx);
+}
+
+/// @brief Read from the log at a cursor with pread, advancing the cursor
+/// @param cur pointer to cursor to read from
+/// @param buf buffer to read into
+/// @param len max # of bytes to read
+/// @return # of bytes read, 0 once the cursor reached its end, -1 on failure
+ssize_t logstore_read(struct log_cursor *cur, void *buf, size_t len){
+	struct log_segment *seg;
+	ssize_t rv = 0;
+	size_t avail;
+
+	if(cur->pos >= cur->end){
+		return 0;
+	}
+
+	seg = segment_get(cur);
+	if(seg == NULL){
+		return -1;
+	}
+
+	avail = segment_avail(cur, seg, len);
+	if(avail > 0){
+		rv = pread(seg->fd, buf, avail, cur->pos - seg->base);
+		if(rv > 0){
+			cur->pos += rv;
+		}
+	}
+
+	segment_put(seg);
+	return rv;
+}
+
+/// @brief Send from the log at a cursor straight to a socket, advancing the
+///        cursor
+/// @param cur pointer to cursor to read from
+/// @param sock_fd socket to send on, may be non-blocking
+/// @param len max # of bytes to send
+/// @return # of bytes sent, 0 once the cursor reached its end, -1 on failure
+///         with errno set
+ssize_t logstore_sendfile(struct log_cursor *cur, int sock_fd, size_t len){
+	struct log_segment *seg;
+	ssize_t rv = 0;
+	size_t avail;
+	off_t seg_off;
+
+	if(cur->pos >= cur->end){
+		return 0;
+	}
+
+	seg = segment_get(cur);
+	if(seg == NULL){
+		return -1;
+	}
+
+	avail = segment_avail(cur, seg, len);
+	if(avail > 0){
+		seg_off = cur->pos - seg->base;
+		rv = sendfile(sock_fd, seg->fd, &seg_off, avail);
+		if(rv > 0){
+			cur->pos += rv;
+		}
+	}
+
+	segment_put(seg);
+	return rv;
+}
+
+/// @brief Delete every retained segment file, the log stays usable until closed
+void logstore_remove(void){
+	char path[PATH_MAX];
+	int i;
+
+	pthread_mutex_lock(&store.list_mtx);
+	for(i = 0; i < store.num_segs; i++){
+		segment_path(store.segs[i]->seq, path);
+		unlink(path);
+	}
+	pthread_mutex_unlock(&store.list_mtx);
+}
+
+/// @brief Close the log and free everything it holds, no readers may be active
+void logstore_close(void){
+	int i;
+
+	for(i = 0; i < store.num_segs; i++){
+		segment_free(store.segs[i]);
+	}
+	free(store.segs);
+	store.segs = NULL;
+	store.num_segs = 0;
+	store.segs_cap = 0;
+
+	pthread_mutex_destroy(&store.list_mtx);
+	pthread_mutex_destroy(&store.append_mtx);
+}
@@ -0,0 +1,30 @@
+// Append-only log of line data split across fixed size segment files
+// Author: James Bohn
+
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define LOGSTORE_SEGMENT_SIZE (1024 * 1024)	// default rotation threshold, bytes
+#define LOGSTORE_MAX_SEGMENTS 0			// default retention, 0 keeps every segment
+#define LOGSTORE_MAX_OPEN 16			// segment fds kept open, others are reopened on demand
+
+// Position of a single reader in the log, as absolute offsets from the first
+// byte ever appended
+struct log_cursor {
+	off_t pos;	// next byte to read
+	off_t end;	// reading stops here
+};
+
+int logstore_open(const char *path, off_t segment_size, int max_segments);
+ssize_t logstore_append(const struct iovec *iov, int iov_cnt);
+void logstore_cursor_init(struct log_cursor *cur);
+ssize_t logstore_read(struct log_cursor *cur, void *buf, size_t len);
+ssize_t logstore_sendfile(struct log_cursor *cur, int sock_fd, size_t len);
+void logstore_remove(void);
+void logstore_close(void);
+
+#endif
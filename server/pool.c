@@ -0,0 +1,170 @@
+// Fixed size worker thread pool fed by a bounded queue of client sockets
+// Accepted sockets go into a ring shared by all workers (multi producer,
+// multi consumer under one lock), and are rejected once the ring is full
+// Author: James Bohn
+
+#include "pool.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+struct worker {
+	pthread_t thread;
+	int client_fd;	// client being served, -1 while idle
+};
+
+// Bounded ring of accepted client sockets waiting for a worker
+struct conn_queue {
+	int *fds;
+	int size;
+	int head;
+	int count;
+	bool closed;
+	pthread_mutex_t mtx;
+	pthread_cond_t not_empty;
+};
+
+static struct conn_queue queue;
+static struct worker *workers = NULL;
+static int num_workers = 0;
+static int busy_workers = 0;	// workers serving a client, under queue.mtx
+static pool_handler handle_client = NULL;
+
+/// @brief Thread body for a worker, serves queued clients until stopped
+/// @param worker_param pointer to the worker struct for this thread
+/// @return NULL
+static void *worker_run(void *worker_param){
+	struct worker *self = (struct worker *) worker_param;
+	int client_fd;
+
+	while(1){
+		pthread_mutex_lock(&queue.mtx);
+		while(queue.count == 0 && !queue.closed){
+			pthread_cond_wait(&queue.not_empty, &queue.mtx);
+		}
+		if(queue.closed){
+			pthread_mutex_unlock(&queue.mtx);
+			break;
+		}
+
+		client_fd = queue.fds[queue.head];
+		queue.head = (queue.head + 1) % queue.size;
+		queue.count -= 1;
+		self->client_fd = client_fd;
+		busy_workers += 1;
+		pthread_mutex_unlock(&queue.mtx);
+
+		handle_client(client_fd);
+
+		pthread_mutex_lock(&queue.mtx);
+		self->client_fd = -1;
+		busy_workers -= 1;
+		pthread_mutex_unlock(&queue.mtx);
+		close(client_fd);
+	}
+
+	return NULL;
+}
+
+/// @brief Create the connection queue and start the worker threads
+/// @param nworkers number of worker threads to run
+/// @param queue_size max # of accepted clients waiting for a worker
+/// @param handler function run by a worker to serve one client, the socket
+///        is closed by the pool once it returns
+/// @return 0 on success, -1 on failure
+int pool_start(int nworkers, int queue_size, pool_handler handler){
+	int i;
+
+	queue.fds = malloc(queue_size * sizeof(int));
+	workers = malloc(nworkers * sizeof(struct worker));
+	if(queue.fds == NULL || workers == NULL){
+		syslog(LOG_ERR, "failed to allocate worker pool");
+		free(queue.fds);
+		free(workers);
+		workers = NULL;
+		return -1;
+	}
+
+	queue.size = queue_size;
+	queue.head = 0;
+	queue.count = 0;
+	queue.closed = false;
+	pthread_mutex_init(&queue.mtx, NULL);
+	pthread_cond_init(&queue.not_empty, NULL);
+	handle_client = handler;
+
+	for(i = 0; i < nworkers; i++){
+		workers[i].client_fd = -1;
+		if(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])){
+			syslog(LOG_ERR, "failed to start worker thread");
+			pool_stop();
+			return -1;
+		}
+		num_workers += 1;
+	}
+
+	return 0;
+}
+
+/// @brief Queue an accepted client for the next free worker
+/// @param client_fd socket of the accepted client, owned by the pool on success
+/// @return 0 on success, -1 if the queue is full and the client was rejected
+int pool_submit(int client_fd){
+	pthread_mutex_lock(&queue.mtx);
+	if(queue.count == queue.size || queue.closed){
+		pthread_mutex_unlock(&queue.mtx);
+		return -1;
+	}
+
+	// clients hold their worker until they disconnect, so say when a new one
+	// is left waiting on them
+	if(busy_workers + queue.count >= num_workers){
+		syslog(LOG_WARNING, "all %d workers busy, client waits for one to disconnect", num_workers);
+	}
+
+	queue.fds[(queue.head + queue.count) % queue.size] = client_fd;
+	queue.count += 1;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.mtx);
+
+	return 0;
+}
+
+/// @brief Stop the workers once they finish their current client and free the
+///        pool. Clients still waiting in the queue are dropped.
+void pool_stop(void){
+	int i;
+
+	pthread_mutex_lock(&queue.mtx);
+	queue.closed = true;
+
+	// wake any worker blocked waiting on its client
+	for(i = 0; i < num_workers; i++){
+		if(workers[i].client_fd != -1){
+			shutdown(workers[i].client_fd, SHUT_RD);
+		}
+	}
+
+	for(; queue.count > 0; queue.count--){
+		close(queue.fds[queue.head]);
+		queue.head = (queue.head + 1) % queue.size;
+	}
+	pthread_cond_broadcast(&queue.not_empty);
+	pthread_mutex_unlock(&queue.mtx);
+
+	for(i = 0; i < num_workers; i++){
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	pthread_cond_destroy(&queue.not_empty);
+	pthread_mutex_destroy(&queue.mtx);
+	free(queue.fds);
+	free(workers);
+	queue.fds = NULL;
+	workers = NULL;
+	num_workers = 0;
+	busy_workers = 0;
+}
@@ -0,0 +1,19 @@
+// Fixed size worker thread pool fed by a bounded queue of client sockets
+// A worker serves one client for the whole connection, so there can be at most
+// as many connected clients making progress as there are workers, later ones
+// wait in the queue until one disconnects
+// Author: James Bohn
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_QUEUE_SIZE 64
+#define POOL_DEFAULT_WORKERS 64	// workers mostly sleep in recv, so size for clients not cores
+
+typedef void (*pool_handler)(int client_fd);
+
+int pool_start(int nworkers, int queue_size, pool_handler handler);
+int pool_submit(int client_fd);
+void pool_stop(void);
+
+#endif
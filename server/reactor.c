@@ -0,0 +1,401 @@
+// Epoll based event loops multiplexing client connections
+// Each loop owns an epoll instance and drives a small state machine per
+// connection instead of dedicating a blocking thread to every client
+// Author: James Bohn
+
+#include "reactor.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#include "vector.h"
+#include "datafile.h"
+
+#define REACTOR_RECV_SIZE 4096
+
+enum conn_state {
+	CONN_RECV,	// waiting for a complete line from the client
+	CONN_SEND,	// echoing the data file back to the client
+};
+
+// Per client state carried between events
+struct connection {
+	int fd;
+	enum conn_state state;
+	bool eof;
+	vector recv_vec;
+	vector send_vec;
+	size_t sent;
+	bool streaming;		// echo is sent straight from the file
+	struct log_cursor cursor;
+	struct data_handle data;	// this connection's own view of the data file
+	struct event_loop *loop;
+	LIST_ENTRY(connection) entries;
+};
+
+struct event_loop {
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;
+	pthread_mutex_t mtx;
+	LIST_HEAD(conn_list, connection) conns;
+};
+
+static struct event_loop *loops = NULL;
+static int num_loops = 0;
+static int next_loop = 0;
+
+/// @brief Change the events a connection is waiting on
+/// @param conn pointer to connection to modify
+/// @param events epoll events to wait for
+/// @return 0 on success, -1 on failure
+static int conn_watch(struct connection *conn, uint32_t events){
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	if(epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1){
+		syslog(LOG_ERR, "error on syscall: epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/// @brief Remove a connection from its loop and release everything it owns
+/// @param conn pointer to connection to close
+static void conn_close(struct connection *conn){
+	pthread_mutex_lock(&conn->loop->mtx);
+	LIST_REMOVE(conn, entries);
+	pthread_mutex_unlock(&conn->loop->mtx);
+
+	epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	vector_close(&conn->recv_vec);
+	vector_close(&conn->send_vec);
+	datafile_put(&conn->data);
+	free(conn);
+
+	syslog(LOG_DEBUG, "Closed connection\n");
+}
+
+/// @brief Send as much of the pending echo as the socket will take
+/// @param conn pointer to connection in the CONN_SEND state
+/// @return 0 on success, -1 if the connection should be closed
+static int conn_send(struct connection *conn){
+	ssize_t rv;
+
+	#if !USE_AESD_CHAR_DEVICE
+	while(conn->streaming && conn->cursor.pos < conn->cursor.end){
+		rv = datafile_sendfile(conn->fd, &conn->cursor);
+		if(rv == -1){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				// come back once the socket drains
+				return conn_watch(conn, EPOLLOUT);
+			}
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: sendfile");
+			return -1;
+		}
+		if(rv == 0){
+			break;
+		}
+	}
+	#endif
+
+	while(!conn->streaming && conn->sent < conn->send_vec.len){
+		rv = send(conn->fd, conn->send_vec.buf + conn->sent,
+				conn->send_vec.len - conn->sent, MSG_NOSIGNAL);
+		if(rv == -1){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				// come back once the socket drains
+				return conn_watch(conn, EPOLLOUT);
+			}
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: send");
+			return -1;
+		}
+		conn->sent += rv;
+	}
+
+	// Echo complete, go back to waiting on the client
+	vector_reset(&conn->send_vec);
+	conn->streaming = false;
+	conn->state = CONN_RECV;
+	if(conn->eof){
+		return -1;
+	}
+
+	return conn_watch(conn, EPOLLIN);
+}
+
+/// @brief Drain the socket, commit complete lines and start the echo
+/// @param conn pointer to connection in the CONN_RECV state
+/// @return 0 on success, -1 if the connection should be closed
+static int conn_recv(struct connection *conn){
+	char recv_buf[REACTOR_RECV_SIZE];
+	size_t scan_from = conn->recv_vec.len;
+	size_t used;
+	bool seek_done = false;
+	ssize_t received;
+
+	while(1){
+		received = recv(conn->fd, recv_buf, REACTOR_RECV_SIZE, 0);
+		if(received == -1){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: recv");
+			return -1;
+		}
+		else if(received == 0){
+			conn->eof = true;
+			break;
+		}
+
+		if(vector_append(&conn->recv_vec, recv_buf, received)){
+			syslog(LOG_ERR, "vec_append fail\n");
+			return -1;
+		}
+	}
+
+	// Nothing to do until a full line shows up
+	if(!vector_find(&conn->recv_vec, scan_from, '\n')){
+		return conn->eof ? -1 : 0;
+	}
+
+	if(datafile_write_lines(&conn->data, &conn->recv_vec, &used, &seek_done)){
+		return -1;
+	}
+
+	// If we have have any extra data in the receive buffer, carry it through
+	// to the next packet, otherwise reset the buffer
+	if(used < conn->recv_vec.len){
+		vector_carryover(&conn->recv_vec, used);
+	}
+	else{
+		vector_reset(&conn->recv_vec);
+	}
+
+	conn->state = CONN_SEND;
+
+	// Stream straight from the file when asked to. The char device can't be
+	// spliced from without blocking on the shared position, so it always goes
+	// through a buffer here.
+	#if !USE_AESD_CHAR_DEVICE
+	if(data_file.zero_copy){
+		datafile_cursor_init(&conn->cursor);
+		conn->streaming = true;
+		return conn_send(conn);
+	}
+	#endif
+
+	if(datafile_read_all(&conn->data, &conn->send_vec, seek_done)){
+		return -1;
+	}
+
+	conn->sent = 0;
+	return conn_send(conn);
+}
+
+/// @brief Thread body for a single event loop
+/// @param loop_param pointer to the event_loop this thread runs
+/// @return NULL
+static void *loop_run(void *loop_param){
+	struct event_loop *loop = (struct event_loop *) loop_param;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct connection *conn, *next;
+	bool running = true;
+	int n, i, rv;
+
+	while(running){
+		n = epoll_wait(loop->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "error on syscall: epoll_wait");
+			break;
+		}
+
+		for(i = 0; i < n; i++){
+			conn = events[i].data.ptr;
+
+			// the wakeup eventfd is registered with a NULL pointer
+			if(conn == NULL){
+				running = false;
+				continue;
+			}
+
+			if(conn->state == CONN_RECV){
+				rv = conn_recv(conn);
+			}
+			else{
+				rv = conn_send(conn);
+			}
+
+			if(rv || (events[i].events & EPOLLERR)){
+				conn_close(conn);
+			}
+		}
+	}
+
+	// Shutting down, drop any connections still attached to this loop
+	LIST_FOREACH_SAFE(conn, &loop->conns, entries, next){
+		conn_close(conn);
+	}
+
+	return NULL;
+}
+
+/// @brief Create and start the event loop threads
+/// @param nloops number of event loops to run
+/// @return 0 on success, -1 on failure
+int reactor_start(int nloops){
+	struct epoll_event ev;
+	int i;
+
+	loops = calloc(nloops, sizeof(struct event_loop));
+	if(loops == NULL){
+		syslog(LOG_ERR, "failed to allocate event loops");
+		return -1;
+	}
+
+	for(i = 0; i < nloops; i++){
+		LIST_INIT(&loops[i].conns);
+		pthread_mutex_init(&loops[i].mtx, NULL);
+
+		loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(loops[i].epoll_fd == -1){
+			syslog(LOG_ERR, "error on syscall: epoll_create1");
+			pthread_mutex_destroy(&loops[i].mtx);
+			reactor_stop();
+			return -1;
+		}
+
+		loops[i].wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if(loops[i].wake_fd == -1){
+			syslog(LOG_ERR, "error on syscall: eventfd");
+			close(loops[i].epoll_fd);
+			pthread_mutex_destroy(&loops[i].mtx);
+			reactor_stop();
+			return -1;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) == -1 ||
+				pthread_create(&loops[i].thread, NULL, loop_run, &loops[i])){
+			syslog(LOG_ERR, "failed to start event loop");
+			close(loops[i].wake_fd);
+			close(loops[i].epoll_fd);
+			pthread_mutex_destroy(&loops[i].mtx);
+			reactor_stop();
+			return -1;
+		}
+
+		num_loops += 1;
+	}
+
+	return 0;
+}
+
+/// @brief Hand a newly accepted client over to one of the event loops
+/// @param client_fd socket of the accepted client, owned by the reactor after
+///        this call
+/// @return 0 on success, -1 on failure
+int reactor_add(int client_fd){
+	struct connection *conn;
+	struct event_loop *loop;
+	struct epoll_event ev;
+	int flags;
+
+	flags = fcntl(client_fd, F_GETFL);
+	if(flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1){
+		syslog(LOG_ERR, "error on syscall: fcntl");
+		close(client_fd);
+		return -1;
+	}
+
+	conn = calloc(1, sizeof(struct connection));
+	if(conn == NULL){
+		syslog(LOG_ERR, "failed to allocate connection");
+		close(client_fd);
+		return -1;
+	}
+
+	if(vector_init(&conn->recv_vec) || vector_init(&conn->send_vec)){
+		syslog(LOG_ERR, "vec_init fail\n");
+		free(conn);
+		close(client_fd);
+		return -1;
+	}
+
+	if(datafile_get(&conn->data)){
+		vector_close(&conn->recv_vec);
+		free(conn);
+		close(client_fd);
+		return -1;
+	}
+
+	// Spread clients over the loops round robin
+	loop = &loops[next_loop];
+	next_loop = (next_loop + 1) % num_loops;
+
+	conn->fd = client_fd;
+	conn->state = CONN_RECV;
+	conn->loop = loop;
+
+	pthread_mutex_lock(&loop->mtx);
+	LIST_INSERT_HEAD(&loop->conns, conn, entries);
+	pthread_mutex_unlock(&loop->mtx);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1){
+		syslog(LOG_ERR, "error on syscall: epoll_ctl");
+		conn_close(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/// @brief Wake every event loop, wait for them to exit and free their state.
+///        Connections still open are closed.
+void reactor_stop(void){
+	uint64_t one = 1;
+	int i;
+
+	for(i = 0; i < num_loops; i++){
+		if(write(loops[i].wake_fd, &one, sizeof(one)) == -1){
+			syslog(LOG_ERR, "error waking event loop");
+		}
+	}
+
+	for(i = 0; i < num_loops; i++){
+		pthread_join(loops[i].thread, NULL);
+		close(loops[i].wake_fd);
+		close(loops[i].epoll_fd);
+		pthread_mutex_destroy(&loops[i].mtx);
+	}
+
+	free(loops);
+	loops = NULL;
+	num_loops = 0;
+}
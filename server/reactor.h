@@ -0,0 +1,13 @@
+// Epoll based event loops multiplexing client connections
+// Author: James Bohn
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#define REACTOR_MAX_EVENTS 64
+
+int reactor_start(int nloops);
+int reactor_add(int client_fd);
+void reactor_stop(void);
+
+#endif
@@ -1,22 +1,170 @@
 // Simple monotonic dynamic array
+// Buffers are only allocated on the first append, grow in place with realloc
+// and are never zeroed. Base size buffers are handed back to a small per
+// thread slab when a vector is closed so the next one can pick them up
+// without touching the allocator.
+// Consumed data is dropped from the front by moving buf forward, the live
+// bytes are only shifted back to the start of the allocation when that frees
+// at least as much room as it costs to copy.
+// Token searches use SSE2 or AVX2 when the CPU has them, picked at runtime,
+// and fall back to memchr everywhere else.
 // Author: James Bohn
 
 #include "vector.h"
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-/// @brief Intializes provided vector by allocating memory for it
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_SCAN_X86 1
+#else
+#define VECTOR_SCAN_X86 0
+#endif
+
+// Finds up to max instances of token in buf, storing their offsets in pos
+typedef size_t (*scan_fn)(const char *buf, size_t len, char token, size_t *pos, size_t max);
+
+// Free base size buffers cached by a single thread
+struct vector_slab {
+    void *bufs[VECTOR_SLAB_SIZE];
+    int cnt;
+};
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+/// @brief Release a thread's cached buffers when it exits
+/// @param slab_param pointer to the exiting thread's slab
+static void slab_destroy(void *slab_param){
+    struct vector_slab *slab = (struct vector_slab *) slab_param;
+
+    while(slab->cnt > 0){
+        free(slab->bufs[--slab->cnt]);
+    }
+    free(slab);
+}
+
+/// @brief Create the key used to find each thread's slab
+static void slab_key_create(void){
+    pthread_key_create(&slab_key, slab_destroy);
+}
+
+/// @brief Get the calling thread's slab, creating it on first use
+/// @return pointer to slab, NULL on failure
+static struct vector_slab *slab_get(void){
+    struct vector_slab *slab;
+
+    pthread_once(&slab_once, slab_key_create);
+    slab = pthread_getspecific(slab_key);
+    if(slab == NULL){
+        slab = calloc(1, sizeof(struct vector_slab));
+        if(slab == NULL || pthread_setspecific(slab_key, slab)){
+            free(slab);
+            return NULL;
+        }
+    }
+
+    return slab;
+}
+
+/// @brief Find token bytes one memchr call at a time
+/// @param buf buffer to search
+/// @param len # of bytes to search
+/// @param token token/byte to search for
+/// @param pos array to store the offsets of found tokens in
+/// @param max size of pos
+/// @return # of tokens found
+static size_t scan_memchr(const char *buf, size_t len, char token, size_t *pos, size_t max){
+    const char *cur = buf;
+    const char *end = buf + len;
+    const char *hit;
+    size_t cnt = 0;
+
+    while(cnt < max && cur < end && (hit = memchr(cur, token, end - cur))){
+        pos[cnt++] = hit - buf;
+        cur = hit + 1;
+    }
+
+    return cnt;
+}
+
+#if VECTOR_SCAN_X86
+/// @brief Find token bytes 16 at a time with SSE2, see scan_memchr
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, char token, size_t *pos, size_t max){
+    __m128i needle = _mm_set1_epi8(token);
+    unsigned int mask;
+    size_t cnt = 0;
+    size_t i;
+
+    for(i = 0; i + 16 <= len && cnt < max; i += 16){
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), needle));
+        while(mask && cnt < max){
+            pos[cnt++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i < len && cnt < max; i++){
+        if(buf[i] == token){
+            pos[cnt++] = i;
+        }
+    }
+
+    return cnt;
+}
+
+/// @brief Find token bytes 32 at a time with AVX2, see scan_memchr
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, char token, size_t *pos, size_t max){
+    __m256i needle = _mm256_set1_epi8(token);
+    unsigned int mask;
+    size_t cnt = 0;
+    size_t i;
+
+    for(i = 0; i + 32 <= len && cnt < max; i += 32){
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), needle));
+        while(mask && cnt < max){
+            pos[cnt++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i < len && cnt < max; i++){
+        if(buf[i] == token){
+            pos[cnt++] = i;
+        }
+    }
+
+    return cnt;
+}
+#endif
+
+static scan_fn scan = scan_memchr;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/// @brief Pick the widest scanner the CPU supports
+static void scan_select(void){
+    #if VECTOR_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        scan = scan_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")){
+        scan = scan_sse2;
+    }
+    #endif
+}
+
+/// @brief Intializes provided vector, memory is allocated on the first append
 /// @param vec pointer to vector to initialize
 /// @return 0 on success, -1 on failure
 int vector_init(vector *vec){
-    vec->buf = malloc(VECTOR_BASE_SIZE);
-    if(vec->buf == NULL){
-        return -1;
-    }
-    
+    vec->buf = NULL;
     vec->len = 0;
-    vec->cap = VECTOR_BASE_SIZE;
-    memset(vec->buf, 0, vec->cap);
+    vec->cap = 0;
+    vec->base = NULL;
 
     return 0;
 }
@@ -27,18 +175,46 @@ int vector_init(vector *vec){
 /// @param len length in bytes of data to append
 /// @return 0 on success, -1 on failure
 int vector_append(vector *vec, void *data, size_t len){
-    while(vec->cap < vec->len + len){
-        void *new_buf = malloc(2*vec->cap);
-        if(new_buf == NULL){
-            return -1;
+    struct vector_slab *slab;
+    size_t consumed = vec->buf - vec->base;
+    size_t new_cap;
+    void *new_base;
+
+    if(vec->cap < consumed + vec->len + len){
+        // Reclaim the consumed front when it's at least as big as what has
+        // to be moved, which keeps the copying linear in the bytes received
+        if(consumed && consumed >= vec->len){
+            memmove(vec->base, vec->buf, vec->len);
+            vec->buf = vec->base;
+            consumed = 0;
+        }
+
+        // Try for a recycled buffer before going to the allocator
+        if(vec->base == NULL && len <= VECTOR_BASE_SIZE){
+            slab = slab_get();
+            if(slab && slab->cnt > 0){
+                vec->base = vec->buf = slab->bufs[--slab->cnt];
+                vec->cap = VECTOR_BASE_SIZE;
+            }
+        }
+
+        new_cap = vec->cap ? vec->cap : VECTOR_BASE_SIZE;
+        while(new_cap < consumed + vec->len + len){
+            new_cap *= 2;
         }
 
-        vec->cap = 2*vec->cap;
-        memset(new_buf, 0, vec->cap);
-        memcpy(new_buf, vec->buf, vec->len);
-        
-        free(vec->buf);
-        vec->buf = new_buf;
+        // realloc can usually extend in place and only copies len bytes
+        // when it can't, the new tail is left uninitialized
+        if(new_cap != vec->cap){
+            new_base = realloc(vec->base, new_cap);
+            if(new_base == NULL){
+                return -1;
+            }
+
+            vec->base = new_base;
+            vec->buf = new_base + consumed;
+            vec->cap = new_cap;
+        }
     }
 
     memcpy(vec->buf + vec->len, data, len);
@@ -47,12 +223,13 @@ int vector_append(vector *vec, void *data, size_t len){
     return 0;
 }
 
-/// @brief carryover unused vector data by softrestting
+/// @brief carryover unused vector data by dropping the used bytes from the
+///        front, nothing is copied
 /// @param vec pointer to vector object to do work on
 /// @param used # of used bytes in the buffer to discard
-void vector_carryover(vector *vec, int used){
-    memcpy(vec->buf, vec->buf + used, vec->len - used);
-    vec->len = vec->len - used;
+void vector_carryover(vector *vec, size_t used){
+    vec->buf += used;
+    vec->len -= used;
 }
 
 /// @brief find the first instance of a token byte in a vector's buffer
@@ -60,22 +237,71 @@ void vector_carryover(vector *vec, int used){
 /// @param offset offset to start the search from in the buffer
 /// @param token token/byte to search for
 /// @return pointer to first found token, NULL if not found
-void *vector_find(vector *vec, int offset, char token){
-    for(int i = offset; i < vec->len; i++){
-        if(*(char *)(vec->buf + i) == token){
-            return vec->buf + i;
-        }
+void *vector_find(vector *vec, size_t offset, char token){
+    size_t pos;
+
+    if(vector_find_all(vec, offset, token, &pos, 1) == 0){
+        return NULL;
     }
 
-    return NULL;
+    return vec->buf + pos;
+}
+
+/// @brief find every instance of a token byte in a vector's buffer, up to max
+/// @param vec pointer to vector object to do work on
+/// @param offset offset to start the search from in the buffer
+/// @param token token/byte to search for
+/// @param pos array to store the offsets (from vec->buf) of found tokens in
+/// @param max size of pos
+/// @return # of tokens found, in order
+size_t vector_find_all(vector *vec, size_t offset, char token, size_t *pos, size_t max){
+    size_t cnt;
+
+    if(offset >= vec->len){
+        return 0;
+    }
+
+    pthread_once(&scan_once, scan_select);
+    cnt = scan(vec->buf + offset, vec->len - offset, token, pos, max);
+    for(size_t i = 0; i < cnt; i++){
+        pos[i] += offset;
+    }
+
+    return cnt;
+}
+
+/// @brief Empty a vector, keeping a base size buffer for the next packet.
+///        Anything bigger is given back so idle vectors don't hold on to it.
+/// @param vec pointer to vector to reset
+void vector_reset(vector *vec){
+    if(vec->cap > VECTOR_BASE_SIZE){
+        vector_close(vec);
+        return;
+    }
+
+    vec->buf = vec->base;
+    vec->len = 0;
 }
 
 /// @brief Free's memory associated with vector and marks it unusable until
-///        reinitialized
+///        reinitialized. Base size buffers go back to the thread's slab.
 /// @param vec pointer to vector to close
 void vector_close(vector *vec){
-    free(vec->buf);
+    struct vector_slab *slab = NULL;
+
+    if(vec->cap == VECTOR_BASE_SIZE){
+        slab = slab_get();
+    }
+
+    if(slab && slab->cnt < VECTOR_SLAB_SIZE){
+        slab->bufs[slab->cnt++] = vec->base;
+    }
+    else{
+        free(vec->base);
+    }
+
     vec->buf = NULL;
     vec->len = 0;
     vec->cap = 0;
-}
\ No newline at end of file
+    vec->base = NULL;
+}
@@ -1,18 +1,27 @@
 // Simple monotonic dynamic array
 // Author: James Bohn
 
+#ifndef VECTOR_H
+#define VECTOR_H
+
 #include <stdio.h>
 
 #define VECTOR_BASE_SIZE 4096
+#define VECTOR_SLAB_SIZE 16	// base size buffers each thread keeps for reuse
 
 typedef struct {
-    void *buf;
-    size_t len;
-    size_t cap;
+    void *buf;	// start of live data, moves forward as data is consumed
+    size_t len;	// # of live bytes at buf
+    size_t cap;	// size of the allocation at base
+    void *base;	// start of the allocation
 } vector;
 
 int vector_init(vector *vec);
 int vector_append(vector *vec, void *data, size_t len);
-void *vector_find(vector *vec, int offset, char token);
-void vector_carryover(vector *vec, int used);
-void vector_close(vector *vec);
\ No newline at end of file
+void *vector_find(vector *vec, size_t offset, char token);
+size_t vector_find_all(vector *vec, size_t offset, char token, size_t *pos, size_t max);
+void vector_carryover(vector *vec, size_t used);
+void vector_reset(vector *vec);
+void vector_close(vector *vec);
+
+#endif